@@ -0,0 +1,71 @@
+#! /bin/sh
+
+# Unpacks sparse copies of an install's game0000.dat that are larger than
+# 4 GiB and checks that they give the same files as the original: once
+# grown past 4 GiB at the end, and once moved behind a 4 GiB hole, so that
+# stream lengths and offsets no longer fit in 32 bits.
+
+set -e
+
+die () {
+    printf >&2 "%s\n" "$*"
+    exit 1
+}
+
+src="${1%/}"
+dat="$src/game/client/game0000.dat"
+mnf="$src/game/client/game.mnf"
+test -f "$dat" -a -f "$mnf" || die "usage: $0 esodir"
+
+test -f build/Makefile ||
+(
+    mkdir -p build
+    cd build && cmake ..
+)
+make -C build
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# the files of an output tree by content, as the names depend on offsets
+contents () {
+    find "$1" -type f ! -name .eso-unpack.journal -exec md5sum {} + |
+        cut -d' ' -f1 | sort
+}
+
+unpack () {
+    build/eso-unpack --save --esodir "$1" --outdir "$2" >"$2.out" 2>"$2.err" ||
+        die "unpacking $1 failed, see $2.err"
+}
+
+mkdir -p "$work/orig/game/client" "$work/grown/game/client" "$work/moved/game/client"
+cp "$mnf" "$work/orig/game/client/"
+cp "$mnf" "$work/grown/game/client/"
+cp --sparse=always "$dat" "$work/orig/game/client/"
+cp --sparse=always "$dat" "$work/grown/game/client/"
+truncate -s $((4 * 1024 * 1024 * 1024 + 0x30)) "$work/grown/game/client/game0000.dat"
+
+printf "checking %s grown past 4 GiB\n" "$dat"
+unpack "$work/orig" "$work/orig-out"
+unpack "$work/grown" "$work/grown-out"
+diff "$work/orig-out.out" "$work/grown-out.out" >&2 ||
+    die "unpacking the grown archive differs"
+diff -r -x .eso-unpack.journal "$work/orig-out" "$work/grown-out" >&2 ||
+    die "files of the grown archive differ"
+
+# the manifest cannot point behind 4 GiB, so both are scanned without one
+printf "checking %s moved behind 4 GiB\n" "$dat"
+rm "$work/orig/game/client/game.mnf" "$work/grown/game/client/game0000.dat"
+truncate -s 4G "$work/moved/game/client/game0000.dat"
+cat "$dat" >>"$work/moved/game/client/game0000.dat"
+rm -rf "$work/orig-out"
+unpack "$work/orig" "$work/orig-out"
+unpack "$work/moved" "$work/moved-out"
+test "$(grep -c extracted "$work/orig-out.out")" = "$(grep -c extracted "$work/moved-out.out")" ||
+    die "the moved archive gives a different number of streams"
+contents "$work/orig-out" >"$work/orig.sum"
+contents "$work/moved-out" >"$work/moved.sum"
+cmp -s "$work/orig.sum" "$work/moved.sum" ||
+    die "files of the moved archive differ"
+
+printf "ok\n"
@@ -30,7 +30,11 @@
 #define ESOUNPACK_ESODATA_H
 
 #include <endian.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#include "recordformat.h"
 
 #ifndef PACKED
 # define PACKED __attribute__((__packed__))
@@ -39,6 +43,8 @@
 
 struct ESOHostEndianBuffer
 {
+    static const ByteOrder order = HOST_BYTE_ORDER;
+
     ESOHostEndianBuffer(const void* ptr)
       : _ptr(reinterpret_cast<const char*>(ptr))
     {}
@@ -67,6 +73,8 @@ struct ESOHostEndianBuffer
 
 struct ESOBigEndianBuffer : ESOHostEndianBuffer
 {
+    static const ByteOrder order = ByteOrder::Big;
+
     ESOBigEndianBuffer(const void* ptr)
       : ESOHostEndianBuffer(ptr)
     {}
@@ -80,6 +88,8 @@ struct ESOBigEndianBuffer : ESOHostEndianBuffer
 
 struct ESOLittleEndianBuffer : ESOHostEndianBuffer
 {
+    static const ByteOrder order = ByteOrder::Little;
+
     ESOLittleEndianBuffer(const void* ptr)
       : ESOHostEndianBuffer(ptr)
     {}
@@ -91,6 +101,34 @@ struct ESOLittleEndianBuffer : ESOHostEndianBuffer
 };
 
 
+// Read-only view of an array of T inside someone else's buffer.
+template <typename T>
+class ArrayView
+{
+public:
+
+    ArrayView()
+      : _data(NULL)
+      , _size(0) {}
+
+    ArrayView(const T* data, size_t size)
+      : _data(data)
+      , _size(size) {}
+
+    const T* data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    const T* begin() const { return _data; }
+    const T* end() const { return _data + _size; }
+    const T& operator[](size_t i) const { return _data[i]; }
+
+private:
+
+    const T*    _data;
+    size_t      _size;
+};
+
+
 struct PACKED ESOBlockType0Header
 {
     uint16_t    blockType;
@@ -98,6 +136,8 @@ struct PACKED ESOBlockType0Header
 };
 
 
+template <ByteOrder O> struct ESOBlockType3Format;
+
 struct PACKED ESOBlockType3Header
 {
     uint16_t    blockType;
@@ -107,18 +147,20 @@ struct PACKED ESOBlockType3Header
     template <typename BufferT>
     bool init(const BufferT buf, size_t buflen)
     {
-        if (buflen < 18) return false;
-
-        this->blockType = buf.u16(0);
-        this->fieldSize = buf.u32(2);
-        this->recordCount[0] = buf.u32(6);
-        this->recordCount[1] = buf.u32(10);
-        this->recordCount[2] = buf.u32(14);
-
+        if (!ESOBlockType3Format<BufferT::order>::decode(buf.ptr(0), buflen, *this)) {
+            return false;
+        }
         return this->blockType == 3;
     }
 };
 
+// big-endian in the MNF, little-endian in the ZOSFT
+template <ByteOrder O>
+struct ESOBlockType3Format : RecordFormat<18,
+    Member<ESOBlockType3Header, uint16_t, &ESOBlockType3Header::blockType, Field<uint16_t, 0, O>>,
+    Member<ESOBlockType3Header, uint32_t, &ESOBlockType3Header::fieldSize, Field<uint32_t, 2, O>>,
+    ArrayMember<ESOBlockType3Header, uint32_t, 3, &ESOBlockType3Header::recordCount, 6, O>> {};
+
 
 union PACKED ESOBlockHeader
 {
@@ -156,47 +198,58 @@ struct PACKED ESOZOSFTBlock2Data3Record
     uint32_t    unknown0x0C;
 };
 
+typedef RecordFormat<16,
+    Field<uint32_t, 0, ByteOrder::Little>,
+    Field<uint32_t, 4, ByteOrder::Little>,
+    Field<uint32_t, 8, ByteOrder::Little>,
+    Field<uint32_t, 12, ByteOrder::Little>> ESOZOSFTBlock2Data3Format;
+
+static_assert(sizeof(ESOZOSFTBlock2Data3Record) == ESOZOSFTBlock2Data3Format::size,
+              "ZOSFT record layout mismatch");
+
 
 template <typename byteT>
 struct ESOSubfileHeader
 {
-    int32_t     null1;
-    int32_t     size1;
+    uint32_t    null1;
+    uint32_t    size1;
     byteT*      data1;
-    int32_t     size2;
+    uint32_t    size2;
     byteT*      data2;
     byteT*      filedata;
 
-    int32_t data1_offset() const
+    size_t data1_offset() const
     {
         return 8;
     }
 
-    int32_t data2_offset() const
+    size_t data2_offset() const
     {
-        return 12 + size1;
+        return 12 + size_t(size1);
     }
 
-    int32_t filedata_offset() const
+    size_t filedata_offset() const
     {
-        return 12 + size1 + size2;
+        return 12 + size_t(size1) + size2;
     }
 
+    typedef Field<uint32_t, 0, ByteOrder::Big> UInt32;
+
     bool init(byteT* bufptr, size_t buflen)
     {
         if (buflen < 8) return false;
 
-        this->null1 = be32toh(*(const int32_t*)(bufptr + 0));
-        this->size1 = be32toh(*(const int32_t*)(bufptr + 4));
+        this->null1 = UInt32::load(bufptr + 0);
+        this->size1 = UInt32::load(bufptr + 4);
         this->data1 = (bufptr + 8);
 
-        int32_t size2off = 8 + this->size1;
+        size_t size2off = 8 + size_t(this->size1);
         if (buflen < size2off + 4) return false;
 
-        this->size2 = be32toh(*(const int32_t*)(bufptr + size2off));
+        this->size2 = UInt32::load(bufptr + size2off);
         this->data2 = (bufptr + size2off + 4);
 
-        int32_t fileoff = 12 + this->size1 + this->size2;
+        size_t fileoff = filedata_offset();
         if (buflen < fileoff) return false;
 
         this->filedata = bufptr + fileoff;
@@ -205,4 +258,47 @@ struct ESOSubfileHeader
 };
 
 
+template <ByteOrder O> struct DDSFormat;
+
+struct DDSHeader
+{
+    uint32_t    height;
+    uint32_t    width;
+    uint32_t    mipMapCount;
+    uint32_t    pixelFormatFlags;
+    char        fourCC[4];
+    uint32_t    rgbBitCount;
+    uint32_t    dxgiFormat;
+
+    bool hasFourCC() const
+    {
+        return (this->pixelFormatFlags & 0x4) != 0;
+    }
+
+    template <typename BufferT>
+    bool init(const BufferT buf, size_t buflen)
+    {
+        if (!DDSFormat<BufferT::order>::decode(buf.ptr(0), buflen, *this)) return false;
+        if (memcmp(buf.ptr(0), "DDS ", 4) || buf.u32(4) != 124) return false;
+
+        this->dxgiFormat = 0;
+
+        // DX10 extension header follows the 124-byte header
+        if (hasFourCC() && !memcmp(this->fourCC, "DX10", 4) && buflen >= 148) {
+            this->dxgiFormat = buf.u32(128);
+        }
+        return true;
+    }
+};
+
+template <ByteOrder O>
+struct DDSFormat : RecordFormat<128,
+    Member<DDSHeader, uint32_t, &DDSHeader::height, Field<uint32_t, 12, O>>,
+    Member<DDSHeader, uint32_t, &DDSHeader::width, Field<uint32_t, 16, O>>,
+    Member<DDSHeader, uint32_t, &DDSHeader::mipMapCount, Field<uint32_t, 28, O>>,
+    Member<DDSHeader, uint32_t, &DDSHeader::pixelFormatFlags, Field<uint32_t, 80, O>>,
+    ArrayMember<DDSHeader, char, 4, &DDSHeader::fourCC, 84, O>,
+    Member<DDSHeader, uint32_t, &DDSHeader::rgbBitCount, Field<uint32_t, 88, O>>> {};
+
+
 #endif // ESOUNPACK_ESODATA_H
@@ -29,43 +29,68 @@
 #define ZLIB_CONST
 
 #include <ctype.h>
+#include <dirent.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <sstream>
 #include <stdexcept>
 #include <vector>
 
 #include "esodata.h"
 #include "fileio.h"
+#include "inflate.h"
+#include "iosched.h"
+#include "journal.h"
+#include "lrucache.h"
+#include "membudget.h"
+#include "pathindex.h"
+#include "server.h"
+#include "store.h"
+#include "subfiles.h"
+#include "tags.h"
+#include "threadpool.h"
+#include "udiff.h"
+#include "watcher.h"
+#include "zosft.h"
 
 
 #define logf(args...) fprintf(stderr, args)
 
-extern "C" uint32_t hash(const char* k, uint32_t length, uint32_t initval);
-
 
 static bool optSaveSubfiles = false;
 static std::string optEsoDir = ".";
 static std::string optOutDir = "game.unpacked";
-
-
-static bool is_valid_path(const char* start, const char* end)
-{
-    for (const char* s = start; s != end; ++s) {
-        if (*s == '\0') {
-            return s != start;
-        }
-        if (!isalnum(*s) && !strchr(" +-./_", *s)) {
-            return false;
-        }
-    }
-    return false;
-}
+static std::string optOldDir;
+static std::string optNewDir;
+static bool optUnified = false;
+static bool optResume = false;
+static std::string optStoreDir;
+static std::string optFromList;
+static std::string optMnf;
+static std::string optDat;
+static std::string optTags;
+static std::string optTagsOptions = "ctags.conf";
+static std::string optSocket = "eso-unpack.sock";
+static unsigned long optCacheSize = 256 << 20;
+static unsigned long optCheckpointSpan = 1 << 20;
+static unsigned long optJobs = 0;
+static unsigned long optMaxMemory = 0;
+static std::string optCommand;
+static std::vector<std::string> g_args;
 
 
 static bool startswith(const char* str, const char* prefix)
@@ -74,9 +99,10 @@ static bool startswith(const char* str, const char* prefix)
 }
 
 
-static bool startswith(std::string str, const char* prefix)
+static bool startswith(const char* str, size_t len, const char* prefix)
 {
-    return std::memcmp(str.c_str(), prefix, std::strlen(prefix)) == 0;
+    size_t plen = std::strlen(prefix);
+    return len >= plen && std::memcmp(str, prefix, plen) == 0;
 }
 
 
@@ -105,108 +131,455 @@ static void make_path(char* path)
 }
 
 
-static std::string outputFilename(const char* outdir, size_t offset, const char* ext)
+// The top directory level takes all offset bits above the lower ones, so
+// archives beyond 4G get more top directories instead of colliding ones.
+static std::string outputPathFromOffset(size_t offset, const char* ext)
 {
     char fn[200];
-    int sub1 = (offset >> 24) & 0xff;
-    int sub2 = (offset >> 16) & 0xff;
-    int len = snprintf(fn, sizeof(fn), "%s/%02x/%02x/%08lx%s", outdir, sub1, sub2, offset, ext);
-    return std::string(fn, len < sizeof(fn) ? len : sizeof(fn));
+    unsigned long sub1 = offset >> 20;
+    int len = snprintf(fn, sizeof(fn), "%03lx/%08lx%s", sub1, offset, ext);
+    return std::string(fn, len < int(sizeof(fn)) ? len : sizeof(fn));
 }
 
 
-static std::string outputPathFromOffset(size_t offset, const char* ext)
+static std::string outputPathFromFileId(uint32_t fileId, const char* heur)
 {
+    const char* dirsep = strrchr(heur, '/');
+    const char* ext = (dirsep ? dirsep + 1 : heur);
     char fn[200];
-    int sub1 = (offset >> 20) & 0xfff;
-    int len = snprintf(fn, sizeof(fn), "%03x/%08lx%s", sub1, offset, ext);
-    return std::string(fn, len < sizeof(fn) ? len : sizeof(fn));
+    int len = snprintf(fn, sizeof(fn), "fileid/%.*s%08x%s",
+                       int(ext - heur), heur, fileId, ext);
+    return std::string(fn, len < int(sizeof(fn)) ? len : sizeof(fn));
+}
+
+
+static WorkerPool& workerPool()
+{
+    static WorkerPool pool(optJobs);
+    return pool;
 }
 
 
-struct SubfileInfo
+struct FileTypeMagic
 {
-    uint32_t    fileId;
-    uint32_t    _maybe_flags1;
-    uint32_t    compressedSize;
-    uint32_t    uncompressedSize;
-    uint32_t    _maybe_contentHash;
-    uint32_t    fileOffset;
-    uint32_t    _maybe_flags2;
+    const char*     magic;
+    size_t          len;
+    const char*     heuristic;
 };
 
-static std::vector<SubfileInfo> g_subfiles;
 
+static const FileTypeMagic g_fileTypeMagics[] = {
+    { "DDS\x20\x7c\x00\x00\x00", 8, "textures/.dds" },
+    { "OTTO", 4, "fonts/.otf" },
+    { "ZOSFT", 5, "zosft/.zosft" },
+    { "\x1bLua", 4, "lua/.luac" },
+    { "\xb8\x67\xb0\xca\xf8\x6d\xb1\x0f", 8, "granny/.gr2" },
+    { "<?xml", 5, "xml/.xml" },
+    { "<GuiXml", 7, "xml/.xml" },
+    { "RIFF", 4, "audio/.riff" },
+    { "BKHD", 4, "audio/.bnk" },
+    { "OggS", 4, "audio/.ogg" },
+    { "FSB5", 4, "audio/.fsb" },
+    { "\x89PNG\r\n\x1a\n", 8, "images/.png" },
+    { "\xff\xd8\xff", 3, "images/.jpg" },
+    { "PK\x03\x04", 4, "archives/.zip" },
+    { NULL, 0, NULL }, // guard
+};
 
-static const char* filetypeHeuristics(const std::string& filedata)
+
+static bool is_text(const char* start, const char* end)
 {
-    size_t head_len = filedata.size();
-    const char* head_buf = filedata.c_str();
+    for (const char* s = start; s != end; ++s) {
+        unsigned char c = *s;
+        if (c < 0x20 && c != '\t' && c != '\n' && c != '\r') {
+            return false;
+        }
+    }
+    return start != end;
+}
 
-    if (head_len >= 8 && !std::memcmp(head_buf, "DDS\x20\x7c\x00\x00\x00", 8)) {
-        return "textures/.dds";
+
+static const char* filetypeHeuristics(const char* head_buf, size_t head_len)
+{
+    for (const FileTypeMagic* m = g_fileTypeMagics; m->magic; ++m) {
+        if (head_len >= m->len && !std::memcmp(head_buf, m->magic, m->len)) {
+            return m->heuristic;
+        }
     }
-    if (head_len >= 4 && !std::memcmp(head_buf, "OTTO", 4)) {
-        return "fonts/.otf";
+
+    // skip UTF-8 byte order mark
+    if (head_len >= 3 && !std::memcmp(head_buf, "\xef\xbb\xbf", 3)) {
+        head_buf += 3;
+        head_len -= 3;
     }
-    if (head_len >= 5 && !std::memcmp(head_buf, "ZOSFT", 5)) {
-        return "zosft/.zosft";
+    if (is_text(head_buf, head_buf + std::min<size_t>(head_len, 256))) {
+        if (startswith(head_buf, head_len, "--") ||
+            startswith(head_buf, head_len, "local ") ||
+            startswith(head_buf, head_len, "function ")) {
+            return "lua/.lua";
+        }
+        if (head_buf[0] == '<') {
+            return "xml/.xml";
+        }
+        return "text/.txt";
     }
     return ".unk";
 }
 
 
-static bool inflateString(const char* in_buf, size_t in_len,
-                          char* out_buf, size_t* out_len)
+static const char* filetypeHeuristics(const std::string& filedata)
 {
-    z_stream zs;
-    zs.next_in = (const Bytef*)in_buf;
-    zs.avail_in = in_len;
-    zs.zalloc = Z_NULL;
-    zs.zfree = Z_NULL;
-    zs.opaque = Z_NULL;
+    return filetypeHeuristics(filedata.data(), filedata.size());
+}
 
-    if (inflateInit(&zs) != Z_OK) {
-        return false;
+
+// The game.mnf manifest of an install and its gameNNNN.dat archives.
+struct GameArchive
+{
+    std::string                                 esodir;
+    std::string                                 mnfFile;    // instead of the one in esodir
+    SubfileTable                                subfiles;
+    std::vector<std::unique_ptr<FileMapping>>   datFiles;
+    std::mutex                                  datMutex;
+
+    std::string mnfPath() const
+    {
+        return mnfFile.empty() ? esodir + "/game/client/game.mnf" : mnfFile;
+    }
+
+    // the archives lie next to the manifest and are named after it,
+    // game.mnf has game0000.dat etc.
+    std::string datPath(unsigned archiveIndex) const
+    {
+        std::string path = mnfPath();
+        char fn[20];
+        snprintf(fn, sizeof(fn), "%04u.dat", archiveIndex);
+        return path.substr(0, path.rfind('.')) + fn;
+    }
+
+    const FileMapping& datFile(unsigned archiveIndex)
+    {
+        std::lock_guard<std::mutex> lock(datMutex);
+        if (archiveIndex >= datFiles.size()) {
+            datFiles.resize(archiveIndex + 1);
+        }
+        std::unique_ptr<FileMapping>& dat = datFiles[archiveIndex];
+        if (!dat) {
+            std::string path = datPath(archiveIndex);
+            std::clog << "mapping " << path << std::endl;
+            dat.reset(new FileMapping(path.c_str())); // throw
+        }
+        return *dat;
     }
+};
+
+static GameArchive g_game;
+
+
+static std::unique_ptr<ContentStore> g_store;
 
-    zs.next_out = (Bytef*)out_buf;
-    zs.avail_out = *out_len;
+static void saveFile(std::string path, const std::string& data)
+{
+    make_path(&path[0]);
 
-    int zerr = inflate(&zs, Z_FINISH);
-    *out_len = zs.next_out - (Bytef*)out_buf;
+    if (g_store) {
+        g_store->save(path, data);
+        return;
+    }
 
-    if (inflateEnd(&zs) != Z_OK) {
-        logf("zlib: %s\n", zs.msg);
+    AtomicFile fw(path, data.size());
+    for (size_t pos = 0; pos < data.size(); ) {
+        pos += fw.file().write(data.data() + pos, data.size() - pos);
     }
+    fw.commit();
+}
+
 
-    return zerr == Z_STREAM_END;
+static const size_t PROBE_PAYLOAD_SIZE = 512;
+static const size_t PROBE_HEADER_LIMIT = 0x10000;
+static const size_t STREAM_CHUNK_SIZE = 0x40000;
+
+// What a SubfileSink takes up front: the chunk it is inflated into, and a
+// chunk of payload past the header probe, which is all it holds before it
+// can spill.
+static const size_t STREAM_MIN_WINDOW = 2 * STREAM_CHUNK_SIZE + PROBE_HEADER_LIMIT;
+
+static MemoryBudget g_budget;
+
+// Subfiles larger than this are not held in memory, but streamed to their
+// output file in chunks. --max-memory is shared by the threads extracting
+// at once, the pool and the caller, less what a sink holds beside the
+// payload: its chunk, and the last one written before it spills.
+static size_t streamWindow()
+{
+    if (!g_budget.limit()) {
+        return 64 << 20;
+    }
+    uint64_t share = g_budget.limit() / (workerPool().size() + 1);
+    return std::max<uint64_t>(STREAM_MIN_WINDOW,
+                              share > 2 * STREAM_CHUNK_SIZE ? share - 2 * STREAM_CHUNK_SIZE : 0);
 }
 
 
+// Receives an inflated subfile in chunks and parses the subfile header off
+// the front. The payload is kept in memory up to the stream window; past
+// that it is spilled to the output file, or dropped if there is none, and
+// only its first bytes are kept for the file type heuristics. A payload
+// starting with "ZOSFT" is always kept whole, it is needed for the names.
+// The output file is preallocated to size less the header, if that is known.
+class SubfileSink
+{
+public:
+
+    SubfileSink(const std::string& path, size_t window, uint64_t size = 0)
+      : _path(path)
+      , _window(window)
+      , _size(size)
+      , _lease(g_budget, STREAM_MIN_WINDOW)
+      , _parsed(false)
+      , _hasHeader(false)
+      , _keepAll(false)
+      , _spilled(false)
+      , _headerSize(0)
+      , _spilledSize(0) {}
+
+    // a STREAM_CHUNK_SIZE buffer for the producer to inflate into, taken
+    // before any payload and covered by the first lease
+    char* chunk()
+    {
+        if (_chunk.empty()) {
+            _chunk.resize(STREAM_CHUNK_SIZE);
+        }
+        return &_chunk[0];
+    }
+
+    void write(const char* data, size_t len)
+    {
+        if (_buf.size() + len > _buf.capacity()) {
+            reserve(_buf.size() + len);
+        }
+        _buf.append(data, len);
+        if (!_parsed && !parseHeader(false)) {
+            return;
+        }
+        if (!_keepAll && _buf.size() >= _window) {
+            spill();
+        }
+    }
+
+    // completes the output file, if any
+    void finish()
+    {
+        if (!_parsed) {
+            parseHeader(true);
+        }
+        if (_spilled) {
+            spill();
+            if (_file) {
+                _file->commit();
+            }
+            if (g_store && !_path.empty()) {
+                g_store->adopt(_path);
+            }
+        }
+        else if (!_path.empty()) {
+            saveFile(_path, _buf);
+        }
+    }
+
+    // the payload, or only its first bytes once it was spilled
+    std::string& data()
+    {
+        return _spilled ? _head : _buf;
+    }
+
+    bool hasHeader() const
+    {
+        return _hasHeader;
+    }
+
+    size_t headerSize() const
+    {
+        return _headerSize;
+    }
+
+    uint64_t payloadSize() const
+    {
+        return _spilledSize + _buf.size();
+    }
+
+    // whether data() is only the start of the payload
+    bool spilled() const
+    {
+        return _spilled;
+    }
+
+private:
+
+    // Makes room for n bytes of payload. The buffer grows while the budget
+    // has room without waiting; when it has not, the payload is spilled
+    // early and its room used again.
+    void reserve(size_t n)
+    {
+        // the whole subfile if its size is known, or doubled, but not past
+        // what the window holds before a spill
+        uint64_t want = (_size ? _size : 2 * _buf.capacity());
+        size_t cap = std::max<uint64_t>(n, std::min<uint64_t>(want, _window + STREAM_CHUNK_SIZE));
+        if (_lease.tryCover(cap + _chunk.size())) {
+            _buf.reserve(cap);
+            return;
+        }
+        cap = n;
+        if (!_lease.tryCover(cap + _chunk.size()) && _parsed && !_keepAll) {
+            size_t len = n - _buf.size();
+            spill();
+            if (_buf.size() + len <= _buf.capacity()) {
+                return;
+            }
+            cap = _buf.size() + len;
+        }
+        if (!_lease.tryCover(cap + _chunk.size())) {
+            // A file table is kept whole for the names however large it
+            // is, so it alone may overdraw the budget. Anything else fits
+            // STREAM_MIN_WINDOW until its header is parsed, and is spilled
+            // after that.
+            _lease.cover(cap + _chunk.size());
+        }
+        _buf.reserve(cap);
+    }
+
+    // the header is looked for in the first PROBE_HEADER_LIMIT bytes
+    bool parseHeader(bool last)
+    {
+        ESOSubfileHeader<const char> hdr = ESOSubfileHeader<const char>();
+        bool ok = hdr.init(_buf.data(), _buf.size());
+        if (!ok && !last && _buf.size() < PROBE_HEADER_LIMIT) {
+            return false;
+        }
+        _headerSize = hdr.filedata_offset();
+        if (ok) {
+            _hasHeader = true;
+            _buf.erase(0, _headerSize);
+        }
+        _parsed = true;
+        return true;
+    }
+
+    void spill()
+    {
+        if (!_spilled) {
+            if (!_buf.compare(0, 5, "ZOSFT")) {
+                _keepAll = true;
+                return;
+            }
+            _head.assign(_buf, 0, PROBE_PAYLOAD_SIZE);
+            _spilled = true;
+            if (!_path.empty()) {
+                std::string path = _path;
+                make_path(&path[0]);
+                _file.reset(new AtomicFile(path, _size > _headerSize ? _size - _headerSize : 0));
+            }
+        }
+        for (size_t pos = 0; _file && pos < _buf.size(); ) {
+            pos += _file->file().write(_buf.data() + pos, _buf.size() - pos);
+        }
+        _spilledSize += _buf.size();
+        _buf.clear();
+    }
+
+    std::string             _path;
+    size_t                  _window;
+    uint64_t                _size;
+    MemoryBudget::Lease     _lease;
+    std::vector<char>       _chunk;
+    std::string             _buf;
+    std::string             _head;
+    std::unique_ptr<AtomicFile> _file;
+    bool                    _parsed;
+    bool                    _hasHeader;
+    bool                    _keepAll;
+    bool                    _spilled;
+    size_t                  _headerSize;
+    uint64_t                _spilledSize;
+};
+
+
 static std::vector<std::string> g_heuristicsResults;
 static std::vector<ssize_t> g_fileOffsets;
+static std::vector<std::string> g_outputPaths;
+static std::vector<std::vector<TagEntry>> g_streamTags;
+static std::vector<int> g_streamTagLanguages;
+
+static std::unique_ptr<TagRules> g_tagRules;
+
+static const TagScanner& tagScanner()
+{
+    thread_local std::unique_ptr<TagScanner> scanner;
+    if (!scanner) {
+        scanner.reset(new TagScanner(*g_tagRules));
+    }
+    return *scanner;
+}
 
-static bool tryInflate(const std::string& outdir, TBuffer<Bytef>& in_buf,
-                       std::string& out_data)
+// One zlib stream extracted by the unpack command. Streams are inflated
+// in parallel; everything that must happen in archive order is done by
+// reportStream() from these results.
+struct ExtractedStream
+{
+    size_t          offset;
+    size_t          consumed;       // compressed length, 0 if it failed
+    size_t          headerSize;
+    const char*     heuristic;      // NULL if there is no subfile header
+    std::string     error;
+    std::string     zosft;          // the payload, if it is the file table
+    int             tagLanguage;    // what tags were scanned as, or -1
+    std::vector<TagEntry> tags;
+};
+
+
+static void finishStream(SubfileSink& sink, ExtractedStream& x);
+
+
+// Inflates the zlib stream at in_ptr, which lies at offset x.offset of the
+// archive. It must be a complete stream within in_len bytes. If the scan
+// kept its decoded output, in_len is its exact length and that is used.
+static void extractStream(const std::string& outdir, const char* in_ptr, size_t in_len,
+                          ExtractedStream& x, const std::string* decoded = NULL)
 {
-    size_t startOffset = in_buf.offset();
-    Bytef* in_ptr;
-    size_t in_size;
     char out_buf[8000];
     z_stream zs;
 
-    out_data.clear();
-    in_buf.next(8000, &in_size, &in_ptr);
+    x.consumed = 0;
+    x.headerSize = 0;
+    x.heuristic = NULL;
+    x.tagLanguage = -1;
+
+    std::string outfile;
+    if (optSaveSubfiles) {
+        outfile = outdir;
+        outfile.append(!endswith(outfile, '/'), '/');
+        outfile.append(outputPathFromOffset(x.offset, ".raw"));
+    }
+    SubfileSink sink(outfile, streamWindow(), decoded ? decoded->size() : 0);
+
+    if (decoded) {
+        // in chunks, like inflated output, so the sink can spill early
+        for (size_t pos = 0; pos < decoded->size(); pos += STREAM_CHUNK_SIZE) {
+            sink.write(decoded->data() + pos, std::min(decoded->size() - pos, STREAM_CHUNK_SIZE));
+        }
+        x.consumed = in_len;
+        finishStream(sink, x);
+        return;
+    }
 
-    zs.next_in = in_ptr;
-    zs.avail_in = in_size;
+    zs.next_in = (const Bytef*)in_ptr;
+    zs.avail_in = 0;
     zs.zalloc = Z_NULL;
     zs.zfree = Z_NULL;
     zs.opaque = Z_NULL;
 
     if (inflateInit(&zs) != Z_OK) {
-        return false;
+        return;
     }
 
     // ensure inflateEnd(zs) gets called upon exception / return
@@ -217,18 +590,13 @@ static bool tryInflate(const std::string& outdir, TBuffer<Bytef>& in_buf,
         zs.next_out = (Bytef*)out_buf;
         zs.avail_out = sizeof(out_buf);
 
+        // in_len may exceed what one zlib call can take
+        refillInput(zs, in_len);
         int zerr = inflate(&zs, Z_NO_FLUSH);
         size_t out_len = zs.next_out - (Bytef*)out_buf;
 
-        if (zs.next_in > in_ptr) {
-            in_buf.consume(zs.next_in - in_ptr);
-            in_buf.next(8000, &in_size, &in_ptr);
-            zs.next_in = in_ptr;
-            zs.avail_in = in_size;
-        }
-
         if (out_len > 0) {
-            out_data.append(out_buf, out_len);
+            sink.write(out_buf, out_len);
         }
 
         if (zerr == Z_STREAM_END) {
@@ -238,76 +606,144 @@ static bool tryInflate(const std::string& outdir, TBuffer<Bytef>& in_buf,
 
         if (zerr != Z_OK) {
             // error
-            std::cerr << "inflate failed at " << in_buf.offset()
-                      << " with error " << zerr << std::endl;
-            return false;
+            std::ostringstream err;
+            err << "inflate failed at " << (x.offset + zs.total_in)
+                << " with error " << zerr;
+            x.error = err.str();
+            return;
         }
     }
 
+    x.consumed = zs.total_in;
     zsGuard.reset();
+    finishStream(sink, x);
+}
 
-    ESOSubfileHeader<const char> hdr = ESOSubfileHeader<const char>();
-    const char* hfn = 0;
 
-    if (hdr.init(out_data.c_str(), out_data.size())) {
-        out_data.erase(0, hdr.filedata_offset());
-        hfn = filetypeHeuristics(out_data);
-    }
+// Completes the output of a stream extracted into sink, and the results
+// that are taken from its payload.
+static void finishStream(SubfileSink& sink, ExtractedStream& x)
+{
+    sink.finish();
 
-    g_fileOffsets.push_back(startOffset);
-    g_heuristicsResults.push_back(hfn ? hfn : "");
+    x.headerSize = sink.headerSize();
+    x.heuristic = (sink.hasHeader() ? filetypeHeuristics(sink.data()) : NULL);
 
-    std::string outfile = outdir;
-    outfile.append(!endswith(outfile, '/'), '/');
-    outfile.append(outputPathFromOffset(startOffset, ".raw"));
+    std::string& data = sink.data();
+    if (g_tagRules && x.heuristic && !sink.spilled()) {
+        // scanned while in memory, as the language its heuristic says
+        x.tagLanguage = g_tagRules->language(x.heuristic);
+        if (x.tagLanguage >= 0) {
+            tagScanner().scan(x.tagLanguage, data.data(), data.size(), x.tags);
+        }
+    }
+    if (!data.compare(0, 5, "ZOSFT") && !data.compare(data.size() - 5, 5, "ZOSFT")) {
+        x.zosft.swap(data);
+    }
+}
 
-    snprintf(out_buf, sizeof(out_buf),
-             "[%04lx] extracted file from offset %08lx ( %08lx %08lx %08lx ) heuristics: %s",
-             g_fileOffsets.size() - 1,
-             startOffset, startOffset - 14,
-             startOffset + hdr.filedata_offset(),
-             startOffset - 14 + hdr.filedata_offset(),
-             hfn ? hfn : "null");
-    std::cout << out_buf << std::endl;
 
-    //std::clog << "writing file " << outfile << std::endl;
-    if (optSaveSubfiles) {
-        make_path(&outfile[0]);
+// What an unpack journal was written for: the size and modification time
+// of the first archive and of the manifest, which a patch changes.
+static std::string archiveIdentity(const GameArchive& game)
+{
+    std::string identity;
+    const char* labels[2] = { "dat", "mnf" };
+    std::string paths[2] = { game.datPath(0), game.mnfPath() };
+    for (int i = 0; i < 2; ++i) {
+        struct stat st;
+        char tmp[80];
+        if (::stat(paths[i].c_str(), &st) == 0) {
+            snprintf(tmp, sizeof(tmp), "%s %llx %llx.%09ld ", labels[i],
+                     (unsigned long long)st.st_size, (unsigned long long)st.st_mtim.tv_sec,
+                     long(st.st_mtim.tv_nsec));
+        }
+        else {
+            snprintf(tmp, sizeof(tmp), "%s - ", labels[i]);
+        }
+        identity.append(tmp);
+    }
+    identity.erase(identity.size() - 1);
+    return identity;
+}
 
-        File fw;
-        fw.open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        fw.write(out_data.data(), out_data.size());
+
+// An extracted stream as recorded in the unpack journal: its compressed
+// length, header size and heuristic, if any.
+static std::string journalEntry(const ExtractedStream& x)
+{
+    char tmp[40];
+    snprintf(tmp, sizeof(tmp), "%lx %lx", x.consumed, x.headerSize);
+    std::string entry = tmp;
+    if (x.heuristic) {
+        entry.append(1, ' ').append(x.heuristic);
     }
+    return entry;
+}
+
+
+// Restores a stream extracted by an earlier run from its journal entry.
+static bool resumeStream(const std::string& entry, ExtractedStream& x)
+{
+    // heuristics of resumed streams live here, the others are literals
+    static std::set<std::string> heuristics;
+    unsigned long consumed, headerSize;
+    int n = 0;
 
+    if (sscanf(entry.c_str(), "%lx %lx%n", &consumed, &headerSize, &n) != 2 || !consumed) {
+        return false;
+    }
+    x.consumed = consumed;
+    x.headerSize = headerSize;
+    x.heuristic = NULL;
+    x.tagLanguage = -1;
+    if (entry[n] == ' ') {
+        x.heuristic = heuristics.insert(entry.substr(n + 1)).first->c_str();
+    }
     return true;
 }
 
 
-static void dumpZOSFT(const std::string& outdir, const std::string& zosft)
+struct DwordStats
 {
-    const char* ptr = zosft.data();
-    size_t size = zosft.size();
+    size_t      nonzeroCount;
+    size_t      uniqueCount;
+    bool        haveHigh;       // any values >= 0x80000000
+    uint32_t    minHigh;
+    uint32_t    maxHigh;
+};
 
-    if (size < sizeof(ESOZOSFTHeader)) return;
 
-    const ESOZOSFTHeader* p_hdr = reinterpret_cast<const ESOZOSFTHeader*>(ptr);
-    size_t offset = sizeof(ESOZOSFTHeader);
+// value statistics of a data block, from a sorted copy
+static DwordStats dwordStats(ArrayView<uint32_t> values)
+{
+    std::vector<uint32_t> sorted(values.begin(), values.end());
+    std::sort(sorted.begin(), sorted.end());
+
+    DwordStats st = DwordStats();
+    st.nonzeroCount = sorted.end() - std::upper_bound(sorted.begin(), sorted.end(), 0u);
+    st.uniqueCount = std::unique(sorted.begin(), sorted.end()) - sorted.begin();
+    sorted.resize(st.uniqueCount);
+
+    auto it = std::lower_bound(sorted.begin(), sorted.end(), 0x80000000u);
+    if (it != sorted.end()) {
+        st.haveHigh = true;
+        st.minHigh = *it;
+        st.maxHigh = sorted.back();
+    }
+    return st;
+}
 
-    std::cout << "ZOSFT dump";
-    std::cout << "\nrecordCount: " << p_hdr->recordCount;
 
-    ESOBlockType3Header blockHeaders[3];
-    struct DataBlockInfo {
-        size_t offset;
-        size_t uncompressedSize;
-        size_t compressedSize;
-        std::string uncompressedData;
-    } dataBlocks[3][3];
+// Diagnostic dump of a ZOSFT table: the block layout, every data block as
+// dwords with statistics, and the filename pool.
+static void dumpZOSFT(const ZosftTable& table)
+{
+    std::cout << "ZOSFT dump";
+    std::cout << "\nrecordCount: " << table.header().recordCount;
 
     for (int bi = 0; bi < 3; ++bi) {
-        ESOBlockType3Header& bh = blockHeaders[bi];
-        if (!bh.init(ESOLittleEndianBuffer(ptr + offset), size - offset)) return;
-        offset += sizeof(bh);
+        const ESOBlockType3Header& bh = table.blockHeader(bi);
         std::cout << "\nblock " << (bi + 1) << " type: " << bh.blockType
                   << "\n        fieldSize: " << bh.fieldSize
                   << "\n        recordCount1: " << bh.recordCount[0]
@@ -315,64 +751,48 @@ static void dumpZOSFT(const std::string& outdir, const std::string& zosft)
                   << "\n        recordCount3: " << bh.recordCount[2];
         for (int di = 0; di < 3; ++di) {
             uint32_t recordCount = bh.recordCount[di];
-            DataBlockInfo& dh = dataBlocks[bi][di];
-            dh.offset = (offset + 8);
-            if (dh.offset > size) return;
+            const ZosftTable::DataBlock& dh = table.block(bi, di);
             if (recordCount == 0) {
-                dh.compressedSize = 0;
-                dh.uncompressedSize = 0;
                 continue;
             }
-            dh.uncompressedSize = le32toh(*(const uint32_t*)(ptr + offset));
-            dh.compressedSize = le32toh(*(const uint32_t*)(ptr + offset + 4));
             std::cout << "\n        data " << (di + 1) << " uncompressedSize: " << dh.uncompressedSize
                       << " = " << recordCount << " * " << ((double)dh.uncompressedSize / recordCount)
                       << "\n               compressedSize: " << dh.compressedSize;
-            offset += 8 + dh.compressedSize;
-            if (offset > size) return;
         }
     }
 
     for (int bi = 0; bi < 3; ++bi) {
         for (int di = 0; di < 3; ++di) {
-            DataBlockInfo& dh = dataBlocks[bi][di];
-            size_t recordCount = blockHeaders[bi].recordCount[di];
+            const ZosftTable::DataBlock& dh = table.block(bi, di);
+            size_t recordCount = table.blockHeader(bi).recordCount[di];
             if (recordCount == 0)
                 continue;
-            size_t uncompressedSize = dh.uncompressedSize;
-            size_t recordSize = uncompressedSize / recordCount;
-            dh.uncompressedData.reserve(uncompressedSize + 4); // make some room for reading dwords
-            dh.uncompressedData.resize(uncompressedSize, '.');
-            bool ok = inflateString(ptr + dh.offset, dh.compressedSize,
-                                    &dh.uncompressedData[0], &uncompressedSize);
+            size_t uncompressedSize = dh.uncompressedData.size();
+            size_t recordSize = dh.uncompressedSize / recordCount;
             std::cout << "\nblock " << (bi + 1) << " data " << (di + 1);
-            if (!ok) {
+            if (!dh.ok) {
                 std::cout << " decompression failed!";
                 continue;
             }
-            if (dh.uncompressedData.size() != uncompressedSize) {
+            if (dh.uncompressedSize != uncompressedSize) {
                 std::cout << " decompressed size mismatch: "
-                          << uncompressedSize << " != " << dh.uncompressedData.size();
+                          << uncompressedSize << " != " << dh.uncompressedSize;
             }
             else {
                 std::cout << " decompressed size: " << uncompressedSize;
             }
-            dh.uncompressedData.resize(uncompressedSize, '.');
             const char* newline = "\n               ";
-            size_t nonzeroCount = 0;
-            std::set<uint32_t> uniqueValues;
-            for (int k = 0; k < uncompressedSize / 4; ++k) {
-                uint32_t v = *(const uint32_t*)(dh.uncompressedData.data() + 4 * k);
-                nonzeroCount += (v != 0);
-                uniqueValues.insert(v);
+            ArrayView<uint32_t> values = table.blockArray<uint32_t>(bi, di);
+            int recPerLine = 1;
+            if (recordSize <= 8) {
+                recPerLine = 4;
+            }
+            else if (recordSize <= 16) {
+                recPerLine = 2;
+            }
+            for (size_t k = 0; k < values.size(); ++k) {
+                uint32_t v = values[k];
                 char tmp[100];
-                int recPerLine = 1;
-                if (recordSize <= 8) {
-                    recPerLine = 4;
-                }
-                else if (recordSize <= 16) {
-                    recPerLine = 2;
-                }
                 if ((4 * k) % (recPerLine * recordSize) == 0) {
                     snprintf(tmp, 100, "%s[%04lx] %08x", newline, (4 * k) / recordSize, v);
                 }
@@ -384,102 +804,99 @@ static void dumpZOSFT(const std::string& outdir, const std::string& zosft)
                 }
                 std::cout << tmp;
             }
-            std::cout << newline << "# of nonzero values: " << nonzeroCount;
-            std::cout << newline << "# of unique values: " << uniqueValues.size();
-            std::set<uint32_t>::iterator it;
-            it = uniqueValues.lower_bound(0x80000000);
-            if (it != uniqueValues.end()) {
-                uint32_t v1 = *it - 0x80000000;
-                uint32_t v2 = *--(it = uniqueValues.end()) - 0x80000000;
-                std::cout << newline << "min nonzero value: 0x80000000 + " << v1;
-                std::cout << newline << "max nonzero value: 0x80000000 + " << v2;
+            DwordStats st = dwordStats(values);
+            std::cout << newline << "# of nonzero values: " << st.nonzeroCount;
+            std::cout << newline << "# of unique values: " << st.uniqueCount;
+            if (st.haveHigh) {
+                std::cout << newline << "min nonzero value: 0x80000000 + " << (st.minHigh - 0x80000000);
+                std::cout << newline << "max nonzero value: 0x80000000 + " << (st.maxHigh - 0x80000000);
             }
         }
     }
 
-    using B2D3 = ESOZOSFTBlock2Data3Record;
+    ArrayView<uint32_t> block0data0 = table.blockArray<uint32_t>(0, 0);
+    ArrayView<uint32_t> block1data0 = table.blockArray<uint32_t>(1, 0);
 
-    const uint32_t* block0data0 = (const uint32_t*)dataBlocks[0][0].uncompressedData.data();
-    const uint32_t* block1data0 = (const uint32_t*)dataBlocks[1][0].uncompressedData.data();
-    const uint32_t* block1data2 = (const uint32_t*)dataBlocks[1][2].uncompressedData.data();
-    const B2D3* block2data3 = (const B2D3*)dataBlocks[1][2].uncompressedData.data();
-    size_t block0data0n = dataBlocks[0][0].uncompressedData.size() / 4;
-    size_t block1data0n = dataBlocks[1][0].uncompressedData.size() / 4;
-    size_t block1data2n = dataBlocks[1][2].uncompressedData.size() / 4;
-    size_t block2data3n = dataBlocks[1][2].uncompressedData.size() / sizeof(B2D3);
-
-    for (size_t i = 0; i < blockHeaders[0].recordCount[0]; ++i) {
+    for (size_t i = 0; i < table.blockHeader(0).recordCount[0]; ++i) {
         char tmp[200];
-        tmp[0] = '\0';
+        int len = 0;
         if (i % 32 == 0) {
-            sprintf(tmp, "\n%-17s%-18s%s", "data 1", "block 1", "block 2");
+            len += snprintf(tmp + len, sizeof(tmp) - len, "\n%-17s%-18s%s",
+                            "data 1", "block 1", "block 2");
         }
-        if (i < block0data0n) {
-            sprintf(tmp, "%s\n%-10s[%04lx] %08x", tmp, "", i, block0data0[i]);
+        if (i < block0data0.size()) {
+            len += snprintf(tmp + len, sizeof(tmp) - len, "\n%-10s[%04lx] %08x",
+                            "", i, block0data0[i]);
         }
         else {
-            sprintf(tmp, "%s\n%-25s", tmp, "");
+            len += snprintf(tmp + len, sizeof(tmp) - len, "\n%-25s", "");
         }
-        if (i < block1data0n) {
-            sprintf(tmp, "%s%-3s[%04lx] %08x", tmp, "", i, block1data0[i]);
+        if (i < block1data0.size()) {
+            len += snprintf(tmp + len, sizeof(tmp) - len, "%-3s[%04lx] %08x",
+                            "", i, block1data0[i]);
         }
         else {
-            sprintf(tmp, "%s%18s", tmp, "");
+            len += snprintf(tmp + len, sizeof(tmp) - len, "%18s", "");
         }
         std::cout << tmp;
     }
 
-    if (offset + 4 > size) return;
-
-    size_t fndataSize = le32toh(*(const uint32_t*)(ptr + offset));
     std::cout << "\n======================================================================";
-    std::cout << "\nFILENAMES data size: " << fndataSize;
+    std::cout << "\nFILENAMES data size: " << table.filenamesSize();
     std::cout << "\nNUM  OFFSET   HASH     FILENAME";
 
-    const char* filenames = ptr + (offset += 4);
-    const char* filenamesEnd = filenames + std::min(fndataSize, size - offset);
+    const char* filenames = table.filenames();
+    const char* filenamesEnd = filenames + table.filenamesSize();
     const char* name = filenames;
-    size_t filenameIndex = 0;
+    std::vector<const char*> names;
+    std::vector<uint32_t> nameLengths;
 
     for (const char* s = filenames; s < filenamesEnd; ++s) {
         if (*s == '\0') {
             if (name < s) {
-                char tmp[300];
-                uint32_t h = hash(name, s - name, 0xa8396u);
-                snprintf(tmp, sizeof(tmp), "\n%04lx %08lx %08x %s",
-                         filenameIndex++, name - filenames, h, name);
-                std::cout << tmp;
+                names.push_back(name);
+                nameLengths.push_back(s - name);
             }
             name = s + 1;
         }
     }
 
+    std::vector<uint32_t> nameHashes(names.size());
+    hash_batch(names.data(), nameLengths.data(), names.size(), ZOSFT_HASH_INITVAL, nameHashes.data());
+
+    for (size_t filenameIndex = 0; filenameIndex < names.size(); ++filenameIndex) {
+        char tmp[300];
+        snprintf(tmp, sizeof(tmp), "\n%04lx %08lx %08x %s",
+                 filenameIndex, names[filenameIndex] - filenames,
+                 nameHashes[filenameIndex], names[filenameIndex]);
+        std::cout << tmp;
+    }
+
     std::cout << std::endl;
+}
 
+
+// Moves the files extracted so far from their offset-based names to their
+// ZOSFT names, or to a directory by file type.
+static void renameExtracted(const std::string& outdir, const ZosftTable& table)
+{
     for (size_t i = 0; i < g_fileOffsets.size(); ++i) {
         ssize_t startOffset = g_fileOffsets.at(i);
         const std::string& heur = g_heuristicsResults.at(i);
         const char* filename = 0;
         uint32_t fileId = 0;
 
-        for (auto const& info : g_subfiles) {
-            if (startOffset == info.fileOffset) {
-                fileId = info.fileId;
-                break;
-            }
+        size_t si = g_game.subfiles.findOffset(0, startOffset);
+        if (si != SubfileTable::npos) {
+            fileId = g_game.subfiles.fileIds()[si];
         }
 
         logf("offset %08lx fileId %04x\n", startOffset, fileId);
 
-        for (size_t j = 0; fileId && j < block2data3n; ++j) {
-            size_t ofs = block2data3[j].filenameOffset;
-            if (fileId == block2data3[j].fileId
-                && ofs < filenamesEnd - filenames
-                && (ofs == 0 || filenames[ofs - 1] == '\0')
-                && is_valid_path(filenames + ofs, filenamesEnd)) {
-                filename = filenames + ofs;
-                logf("ZOSFT name found for file at offset %08lx : %s\n", startOffset, filename);
-            }
+        const ZosftTable::Record* rec = (fileId ? table.findFileId(fileId) : NULL);
+        if (rec) {
+            filename = table.filename(*rec);
+            logf("ZOSFT name found for file at offset %08lx : %s\n", startOffset, filename);
         }
 
         std::string oldpath = outdir;
@@ -489,6 +906,7 @@ static void dumpZOSFT(const std::string& outdir, const std::string& zosft)
         std::string newpath = outdir;
         std::string reason;
         newpath.append(!endswith(newpath, '/'), '/');
+        size_t relpath = newpath.size();
 
         if (filename) {
             reason = "ZOSFT filename";
@@ -512,19 +930,27 @@ static void dumpZOSFT(const std::string& outdir, const std::string& zosft)
 
         std::clog << "renaming " << oldpath << " to " << newpath
                   << " (" << reason << ")" << std::endl;
+        g_outputPaths.at(i) = newpath.substr(relpath);
         if (optSaveSubfiles) {
             make_path(&newpath[0]);
-            rename(oldpath.c_str(), newpath.c_str());
+            // with --store both names may be links to one object, then
+            // rename() succeeds but keeps oldpath
+            if (rename(oldpath.c_str(), newpath.c_str()) == 0) {
+                unlink(oldpath.c_str());
+            }
         }
     }
 }
 
 
-static void readMNF(const char* path)
+static void readMNF(GameArchive& game, bool dump = true)
 {
-    FileMapping fr(path);
+    std::string path = game.mnfPath();
+    std::clog << "reading " << path << std::endl;
+    FileMapping fr(path.c_str());
+    std::ostream dumpout(dump ? std::cout.rdbuf() : NULL);
 
-    if (fr.size() < sizeof(ESOMNFFileHeader)) {
+    if (fr.size() < off_t(sizeof(ESOMNFFileHeader))) {
         fr.error("file header truncated");
     }
 
@@ -550,7 +976,6 @@ static void readMNF(const char* path)
         blockCount++;
         std::clog << " block #" << blockCount << " type " << blockType << "\n";
         if (blockType == 3) {
-            char strbuf[200];
             ESOBlockType3Header bh;
             bh.init(blkbuf, fr.size() - offset);
             logf("  field size:     %6d\n", bh.fieldSize);
@@ -559,70 +984,79 @@ static void readMNF(const char* path)
             logf("  record count #3:%6d\n", bh.recordCount[2]);
             size_t subfileCount = bh.recordCount[2];
             size_t dataOffset = sizeof(bh);
-            std::string uncompressedData;
-            g_subfiles.resize(subfileCount);
+            game.subfiles.resize(subfileCount);
+
+            struct DataBlock
+            {
+                const char*     compressedData;
+                size_t          compressedSize;
+                size_t          uncompressedSize;
+                size_t          numCols;
+                std::string     data;
+                bool            ok;
+            };
+            DataBlock blocks[3];
+
             for (int di = 1; di <= 3; ++di) {
-                size_t uncompressedSize = blkbuf.u32(dataOffset);
-                size_t compressedSize = blkbuf.u32(dataOffset + 4);
-                size_t compressedDataOffset = dataOffset + 8;
+                DataBlock& db = blocks[di - 1];
+                db.uncompressedSize = blkbuf.u32(dataOffset);
+                db.compressedSize = blkbuf.u32(dataOffset + 4);
+                db.compressedData = blkbuf.ptr(dataOffset + 8);
+                db.numCols = 1;
                 size_t recordCount = bh.recordCount[di - 1];
-                size_t numCols = 1;
-                logf("  data size #%d:   %6ld  uncompressed: %6ld", di, compressedSize, uncompressedSize);
+                logf("  data size #%d:   %6ld  uncompressed: %6ld", di, db.compressedSize, db.uncompressedSize);
                 if (recordCount > 0) {
-                    double recordSize = uncompressedSize / (double)recordCount;
+                    double recordSize = db.uncompressedSize / (double)recordCount;
                     logf("  record size: %4.1f", recordSize);
-                    numCols = (recordSize == 4.0 ? 4 : recordSize == 8.0 ? 2 : 1);
+                    db.numCols = (recordSize == 4.0 ? 4 : recordSize == 8.0 ? 2 : 1);
                 }
                 logf("  pos: %08lx\n", offset + dataOffset + 8);
-                dataOffset += 8 + compressedSize;
+                dataOffset += 8 + db.compressedSize;
+            }
 
-                uncompressedData.reserve(uncompressedSize + 4); // make some room for reading dwords
-                uncompressedData.resize(uncompressedSize, '.');
-                bool ok = inflateString(blkbuf.ptr(compressedDataOffset), compressedSize,
-                                        &uncompressedData[0], &uncompressedSize);
+            // the three data are independent of each other
+            workerPool().parallelFor(3, 1, [&blocks](size_t begin, size_t end) {
+                for (size_t b = begin; b < end; ++b) {
+                    DataBlock& db = blocks[b];
+                    db.data.reserve(db.uncompressedSize + 4); // make some room for reading dwords
+                    db.data.resize(db.uncompressedSize, '.');
+                    db.ok = inflateString(db.compressedData, db.compressedSize,
+                                          &db.data[0], &db.uncompressedSize);
+                }
+            });
 
-                std::cout << "\nblock #" << blockCount << " data #" << di;
+            for (int di = 1; di <= 3; ++di) {
+                std::string& uncompressedData = blocks[di - 1].data;
+                size_t uncompressedSize = blocks[di - 1].uncompressedSize;
+                size_t numCols = blocks[di - 1].numCols;
+                bool ok = blocks[di - 1].ok;
+
+                dumpout << "\nblock #" << blockCount << " data #" << di;
                 if (!ok) {
-                    std::cout << " decompression failed!";
+                    dumpout << " decompression failed!";
                     continue;
                 }
                 if (uncompressedData.size() != uncompressedSize) {
-                    std::cout << " decompressed size mismatch: "
+                    dumpout << " decompressed size mismatch: "
                               << uncompressedSize << " != " << uncompressedData.size();
                 }
                 else {
-                    std::cout << " decompressed size: " << uncompressedSize;
+                    dumpout << " decompressed size: " << uncompressedSize;
                 }
                 uncompressedData.resize(uncompressedSize, '.');
 
                 ESOLittleEndianBuffer databuf(uncompressedData.data());
 
-                for (size_t fi = 0; di == 2 && fi < subfileCount; ++fi) {
-                    size_t ofs = fi * 8;
-                    if (ofs + 8 > uncompressedSize) {
-                        break;
-                    }
-                    SubfileInfo& info = g_subfiles.at(fi);
-                    info.fileId = databuf.u32(ofs + 0);
-                    info._maybe_flags1 = databuf.u32(ofs + 4);
+                if (di == 2) {
+                    game.subfiles.decodeIds(uncompressedData.data(), uncompressedSize);
                 }
-
-                for (size_t fi = 0; di == 3 && fi < subfileCount; fi++) {
-                    size_t ofs = fi * 20;
-                    if (ofs + 20 > uncompressedSize) {
-                        break;
-                    }
-                    SubfileInfo& info = g_subfiles.at(fi);
-                    info.compressedSize = databuf.u32(ofs + 0);
-                    info.uncompressedSize = databuf.u32(ofs + 4);
-                    info._maybe_contentHash = databuf.u32(ofs + 8);
-                    info.fileOffset = databuf.u32(ofs + 12);
-                    info._maybe_flags2 = databuf.u32(ofs + 16);
+                else if (di == 3) {
+                    game.subfiles.decodeLocations(uncompressedData.data(), uncompressedSize);
                 }
 
                 char rec[200];
                 for (size_t ri = 0, rn = (uncompressedSize / 4 + numCols - 1) / numCols;
-                     di == 1 && ri < rn; ++ri) {
+                     dump && di == 1 && ri < rn; ++ri) {
                     snprintf(rec, sizeof(rec), "\n");
                     for (size_t ci = 0; ci < numCols; ++ci) {
                         size_t ofs = (ri + rn * ci) * 4;
@@ -632,10 +1066,10 @@ static void readMNF(const char* path)
                                      ofs / 4, databuf.u32(ofs));
                         }
                     }
-                    std::cout << rec;
+                    dumpout << rec;
                 }
                 for (size_t ri = 0, rn = (uncompressedSize / 8 + numCols - 1) / numCols;
-                     di == 2 && ri < rn; ++ri) {
+                     dump && di == 2 && ri < rn; ++ri) {
                     snprintf(rec, sizeof(rec), "\n");
                     for (size_t ci = 0; ci < numCols; ++ci) {
                         size_t ofs = (ri + rn * ci) * 8;
@@ -645,9 +1079,9 @@ static void readMNF(const char* path)
                                      ofs / 8, databuf.u32(ofs), databuf.u32(ofs + 4));
                         }
                     }
-                    std::cout << rec;
+                    dumpout << rec;
                 }
-                for (size_t ofs = 0; di == 3 && ofs < uncompressedSize; ofs += 20) {
+                for (size_t ofs = 0; dump && di == 3 && ofs < uncompressedSize; ofs += 20) {
                     uint32_t datUncompressedSize = databuf.u32(ofs);
                     uint32_t datCompressedSize = databuf.u32(ofs + 4);
                     uint32_t datFileHash = databuf.u32(ofs + 8);
@@ -657,9 +1091,9 @@ static void readMNF(const char* path)
                              "\n  [%04lx]  def %08x  inf %08x  hash %08x  ofs %08x  info %08x",
                              ofs / 20, datCompressedSize, datUncompressedSize,
                              datFileHash, datFileOffset, datFileInfo);
-                    std::cout << rec;
+                    dumpout << rec;
                 }
-                std::cout << "\n";
+                dumpout << "\n";
             }
             offset += dataOffset;
             logf("  end pos %08lx\n", offset);
@@ -668,6 +1102,8 @@ static void readMNF(const char* path)
             fr.error("unknown block type");
         }
     }
+
+    game.subfiles.buildIndex();
 }
 
 
@@ -676,17 +1112,64 @@ struct opt_t
     const char*     lname;
     bool*           boolval;
     std::string*    strval;
+    unsigned long*  numval;
 };
 
 
 static opt_t g_opts[] = {
-    { "--esodir", NULL, &optEsoDir },
-    { "--outdir", NULL, &optOutDir },
-    { "--save", &optSaveSubfiles, NULL },
-    { NULL }, // guard
+    { "--esodir", NULL, &optEsoDir, NULL },
+    { "--outdir", NULL, &optOutDir, NULL },
+    { "--save", &optSaveSubfiles, NULL, NULL },
+    { "--old", NULL, &optOldDir, NULL },
+    { "--new", NULL, &optNewDir, NULL },
+    { "--unified", &optUnified, NULL, NULL },
+    { "--resume", &optResume, NULL, NULL },
+    { "--store", NULL, &optStoreDir, NULL },
+    { "--from-list", NULL, &optFromList, NULL },
+    { "--mnf", NULL, &optMnf, NULL },
+    { "--dat", NULL, &optDat, NULL },
+    { "--tags", NULL, &optTags, NULL },
+    { "--tags-options", NULL, &optTagsOptions, NULL },
+    { "--socket", NULL, &optSocket, NULL },
+    { "--cache-size", NULL, NULL, &optCacheSize },
+    { "--checkpoint-span", NULL, NULL, &optCheckpointSpan },
+    { "--jobs", NULL, NULL, &optJobs },
+    { "--max-memory", NULL, NULL, &optMaxMemory },
+    { NULL, NULL, NULL, NULL }, // guard
 };
 
 
+// accepts K, M and G suffixes
+static bool parsenum(const char* str, unsigned long* val)
+{
+    char* end;
+    unsigned long v = std::strtoul(str, &end, 0);
+    switch (*end) {
+        case 'G': v <<= 10; // fall through
+        case 'M': v <<= 10; // fall through
+        case 'K': v <<= 10; ++end;
+    }
+    if (end == str || *end != '\0') {
+        return false;
+    }
+    *val = v;
+    return true;
+}
+
+
+static bool setopt(const opt_t* opt, const char* val)
+{
+    if (opt->strval) {
+        opt->strval->assign(val);
+    }
+    else if (opt->numval && !parsenum(val, opt->numval)) {
+        std::cerr << "invalid number for " << opt->lname << ": " << val << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
 static int parseopts(int argc, char** argv)
 {
     for (int i = 1; i < argc; ++i) {
@@ -703,8 +1186,8 @@ static int parseopts(int argc, char** argv)
                     std::cerr << "boolean option " << opt->lname << " cannot have value" << std::endl;
                     return 2;
                 }
-                else if (opt->strval) {
-                    opt->strval->assign(arg + len + 1);
+                else if (!setopt(opt, arg + len + 1)) {
+                    return 2;
                 }
                 goto NEXT_ARG;
             }
@@ -712,84 +1195,1791 @@ static int parseopts(int argc, char** argv)
                 if (opt->boolval) {
                     *opt->boolval = true;
                 }
-                else if (opt->strval) {
+                else {
                     if (++i >= argc) {
                         std::cerr << "missing argument for " << opt->lname << std::endl;
                         return 2;
                     }
-                    opt->strval->assign(argv[i]);
+                    if (!setopt(opt, argv[i])) {
+                        return 2;
+                    }
                 }
                 goto NEXT_ARG;
             }
         }
 
+        if (arg[0] != '-' || !arg[1]) {
+            if (optCommand.empty()) {
+                optCommand.assign(arg);
+            }
+            else {
+                g_args.push_back(arg);
+            }
+            continue;
+        }
+
         std::cerr << "unknown option: " << argv[i] << std::endl;
         return 2;
 
         NEXT_ARG: continue;
     }
 
+    if (optCommand.empty()) {
+        optCommand = "unpack";
+    }
     return 0;
 }
 
 
-int main(int argc, char** argv)
+// zlib header: deflate with a window of at most 32K, no preset dictionary,
+// and a valid check value
+static bool is_zlib_header(const unsigned char* p)
 {
-    try {
-        int res = parseopts(argc, argv);
-        if (res)
-            return res;
+    return (p[0] & 0x0f) == Z_DEFLATED && (p[0] >> 4) <= 7 &&
+           !(p[1] & 0x20) && ((p[0] << 8) | p[1]) % 31 == 0;
+}
+
+
+// Subfiles kept uncompressed in the archive: the sizes are equal. Any
+// other subfile must inflate, one that does not start like a zlib stream
+// is corrupt or of an unknown encoding and fails like it.
+static bool isStoredSubfile(const SubfileInfo& info)
+{
+    return info.compressedSize == info.uncompressedSize;
+}
+
+
+// The payload of a stored subfile, in place in the archive mapping.
+static bool storedPayload(GameArchive& game, const SubfileInfo& info,
+                          const char** p_data, uint64_t* p_len)
+{
+    const FileMapping& dat = game.datFile(info._maybe_archiveIndex());
+
+    if (info.fileOffset + info.compressedSize > uint64_t(dat.size())) {
+        return false;
     }
-    catch (std::exception& e) {
-        std::cerr << "error: " << e.what() << std::endl;
-        return 1;
+
+    const char* data = dat.data() + info.fileOffset;
+    ESOSubfileHeader<const char> hdr;
+    size_t hdr_len = 0;
+    if (hdr.init(data, std::min<uint64_t>(info.compressedSize, PROBE_HEADER_LIMIT))) {
+        hdr_len = hdr.filedata_offset();
     }
+    *p_data = data + hdr_len;
+    *p_len = info.compressedSize - hdr_len;
+    return true;
+}
 
-    try {
-        std::string game_mnf = optEsoDir + "/game/client/game.mnf";
-        std::clog << "reading " << game_mnf << std::endl;
-        readMNF(game_mnf.c_str());
+
+// Writes the payload of a stored subfile to path, copying it from the
+// archive in the kernel instead of through a buffer.
+static bool copyStoredSubfile(GameArchive& game, const SubfileInfo& info, std::string path)
+{
+    const FileMapping& dat = game.datFile(info._maybe_archiveIndex());
+    const char* data;
+    uint64_t len;
+
+    if (!storedPayload(game, info, &data, &len)) {
+        return false;
     }
-    catch (std::exception& e) {
-        std::cerr << "error: " << e.what() << std::endl;
+
+    make_path(&path[0]);
+    // not preallocated, the copy may share the archive's extents
+    AtomicFile fw(path);
+    fw.file().copyFrom(dat.fd(), data - dat.data(), len);
+    fw.commit();
+    if (g_store) {
+        g_store->adopt(path);
     }
+    return true;
+}
 
-    try {
-        std::string game_dat = optEsoDir + "/game/client/game0000.dat";
-        std::clog << "reading " << game_dat << "\n";
-        File frdata(game_dat, O_RDONLY);
-        TBuffer<Bytef> in_buf(256000, frdata);
-        Bytef* in_ptr;
-        std::string out_data;
-        size_t in_size;
-        while (in_buf.next(8000, &in_size, &in_ptr)) {
-            size_t z_pos = 0;
-            for (; z_pos < in_size; ++z_pos) {
-                Bytef CompressionMethodAndFlags = in_ptr[z_pos];
-                Bytef CompressionMethod = CompressionMethodAndFlags & 0x0f;
-                if (CompressionMethod != Z_DEFLATED) {
-                    continue;
-                }
-                Bytef CompressionInfo = (CompressionMethodAndFlags >> 4) & 0x0f;
-                if (CompressionInfo > 7) {
-                    continue;
-                }
-                break;
-            }
-            in_buf.consume(z_pos);
-            if (z_pos < in_size) {
-                //std::clog << "found possible zlib block at " << in_buf.offset(z_pos) << std::endl;
-                bool good = tryInflate(optOutDir, in_buf, out_data);
-                if (!good) {
-                    in_buf.consume(1);
-                }
-                else if (!out_data.compare(0, 5, "ZOSFT") &&
-                         !out_data.compare(out_data.size() - 5, 5, "ZOSFT")) {
-                    dumpZOSFT(optOutDir, out_data);
-                    std::cout << std::endl;
+
+// Copies a stored subfile of the first archive that the unpack command
+// found through the manifest, with the results extractStream() gives for
+// an inflated one.
+static void copyStoredStream(const std::string& outdir, const SubfileInfo& info,
+                             ExtractedStream& x)
+{
+    const char* data;
+    uint64_t len;
+
+    x.consumed = 0;
+    x.headerSize = 0;
+    x.heuristic = NULL;
+    x.tagLanguage = -1;
+
+    if (!storedPayload(g_game, info, &data, &len)) {
+        std::ostringstream err;
+        err << "stored subfile at " << x.offset << " runs past the end of the archive";
+        x.error = err.str();
+        return;
+    }
+    if (optSaveSubfiles) {
+        std::string outfile = outdir;
+        outfile.append(!endswith(outfile, '/'), '/');
+        outfile.append(outputPathFromOffset(x.offset, ".raw"));
+        copyStoredSubfile(g_game, info, outfile);
+    }
+
+    x.consumed = info.compressedSize;
+    x.headerSize = info.compressedSize - len;
+    if (x.headerSize) {
+        x.heuristic = filetypeHeuristics(data, len);
+    }
+    if (g_tagRules && x.heuristic) {
+        // scanned in place in the archive mapping
+        x.tagLanguage = g_tagRules->language(x.heuristic);
+        if (x.tagLanguage >= 0) {
+            tagScanner().scan(x.tagLanguage, data, len, x.tags);
+        }
+    }
+    if (len >= 5 && !memcmp(data, "ZOSFT", 5) && !memcmp(data + len - 5, "ZOSFT", 5)) {
+        x.zosft.assign(data, len);
+    }
+}
+
+
+// Inflates just enough of a subfile to parse its header and the first
+// PROBE_PAYLOAD_SIZE bytes of payload, which are left in head.
+static bool probeSubfile(GameArchive& game, const SubfileInfo& info, std::string& head)
+{
+    const FileMapping& dat = game.datFile(info._maybe_archiveIndex());
+
+    if (info.fileOffset >= uint64_t(dat.size())) {
+        return false;
+    }
+
+    if (isStoredSubfile(info)) {
+        const char* data;
+        uint64_t len;
+        if (!storedPayload(game, info, &data, &len)) {
+            return false;
+        }
+        head.assign(data, std::min<uint64_t>(len, PROBE_PAYLOAD_SIZE));
+        return true;
+    }
+
+    const char* in_ptr = dat.data() + info.fileOffset;
+    size_t in_len = std::min<size_t>(info.compressedSize, dat.size() - info.fileOffset);
+    size_t want = PROBE_PAYLOAD_SIZE;
+
+    while (true) {
+        ESOSubfileHeader<const char> hdr;
+        size_t out_len = want;
+
+        head.resize(want);
+        if (!inflatePrefix(in_ptr, in_len, &head[0], &out_len)) {
+            return false;
+        }
+        head.resize(out_len);
+
+        if (hdr.init(head.data(), out_len)) {
+            size_t payload_len = std::min(out_len - hdr.filedata_offset(), PROBE_PAYLOAD_SIZE);
+            if (payload_len == PROBE_PAYLOAD_SIZE || out_len < want) {
+                head.erase(0, hdr.filedata_offset());
+                head.resize(payload_len);
+                return true;
+            }
+            want = hdr.filedata_offset() + PROBE_PAYLOAD_SIZE;
+        }
+        else if (out_len < want || want >= PROBE_HEADER_LIMIT) {
+            return true; // no subfile header, classify the raw data
+        }
+        else {
+            want *= 8;
+        }
+    }
+}
+
+
+// Inflates a whole subfile and strips its header. Stored ones are copied.
+static bool inflateSubfile(GameArchive& game, const SubfileInfo& info, std::string& out_data)
+{
+    const FileMapping& dat = game.datFile(info._maybe_archiveIndex());
+
+    if (info.fileOffset >= uint64_t(dat.size())) {
+        return false;
+    }
+
+    if (isStoredSubfile(info)) {
+        const char* data;
+        uint64_t len;
+        if (!storedPayload(game, info, &data, &len)) {
+            return false;
+        }
+        out_data.assign(data, len);
+        return true;
+    }
+
+    size_t in_len = std::min<uint64_t>(info.compressedSize, dat.size() - info.fileOffset);
+    z_stream zs;
+    zs.next_in = (const Bytef*)dat.data() + info.fileOffset;
+    zs.avail_in = 0;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+
+    if (inflateInit(&zs) != Z_OK) {
+        return false;
+    }
+
+    // ensure inflateEnd(zs) gets called upon exception / return
+    std::unique_ptr<z_stream, int (&)(z_streamp)> zsGuard(&zs, inflateEnd);
+
+    out_data.resize(std::max<size_t>(info.uncompressedSize, 4096));
+    size_t out_len = 0;
+
+    while (true) {
+        if (out_len == out_data.size()) {
+            out_data.resize(2 * out_len);
+        }
+        zs.next_out = (Bytef*)&out_data[out_len];
+        zs.avail_out = zlibCount(out_data.size() - out_len);
+
+        refillInput(zs, in_len);
+        int zerr = inflate(&zs, Z_NO_FLUSH);
+        out_len = zs.next_out - (const Bytef*)out_data.data();
+
+        if (zerr == Z_STREAM_END) {
+            break;
+        }
+        if (zerr != Z_OK && !(zerr == Z_BUF_ERROR && zs.avail_out == 0)) {
+            return false;
+        }
+    }
+
+    out_data.resize(out_len);
+
+    ESOSubfileHeader<const char> hdr;
+    if (hdr.init(out_data.data(), out_data.size())) {
+        out_data.erase(0, hdr.filedata_offset());
+    }
+    return true;
+}
+
+
+// Inflates a subfile through the sink's chunk buffer, for subfiles too
+// large to be held in memory.
+static bool streamSubfile(GameArchive& game, const SubfileInfo& info, SubfileSink& sink)
+{
+    const FileMapping& dat = game.datFile(info._maybe_archiveIndex());
+
+    if (info.fileOffset >= uint64_t(dat.size())) {
+        return false;
+    }
+
+    const char* in_ptr = dat.data() + info.fileOffset;
+    size_t in_len = std::min<size_t>(info.compressedSize, dat.size() - info.fileOffset);
+
+    bool ok = inflateChunked(in_ptr, in_len, sink.chunk(), STREAM_CHUNK_SIZE,
+                             [&sink](const char* data, size_t len) {
+                                 sink.write(data, len);
+                                 return true;
+                             });
+    if (ok) {
+        sink.finish();
+    }
+    return ok;
+}
+
+
+// Inflates a subfile only until want bytes of its payload are there, for
+// reading part of subfiles too large to inflate whole. The first skip
+// bytes of the payload are dropped on the way. The header is looked for
+// the same way SubfileSink does.
+static bool inflateSubfilePrefix(GameArchive& game, const SubfileInfo& info, uint64_t want,
+                                 std::string& out_data, uint64_t skip = 0)
+{
+    const FileMapping& dat = game.datFile(info._maybe_archiveIndex());
+
+    if (info.fileOffset >= uint64_t(dat.size())) {
+        return false;
+    }
+
+    const char* in_ptr = dat.data() + info.fileOffset;
+    size_t in_len = std::min<uint64_t>(info.compressedSize, dat.size() - info.fileOffset);
+    std::vector<char> chunk(STREAM_CHUNK_SIZE);
+    ESOSubfileHeader<const char> hdr;
+    bool parsed = false;
+    uint64_t dropped = 0;
+
+    // once the header is parsed off the front, out_data is all payload
+    auto drop = [&]() {
+        size_t n = std::min<uint64_t>(skip - dropped, out_data.size());
+        out_data.erase(0, n);
+        dropped += n;
+    };
+
+    out_data.clear();
+    bool ok = inflateChunked(in_ptr, in_len, chunk.data(), chunk.size(),
+                             [&](const char* data, size_t len) {
+                                 out_data.append(data, len);
+                                 if (!parsed) {
+                                     if (hdr.init(out_data.data(), out_data.size())) {
+                                         out_data.erase(0, hdr.filedata_offset());
+                                     }
+                                     else if (out_data.size() < PROBE_HEADER_LIMIT) {
+                                         return true;
+                                     }
+                                     parsed = true;
+                                 }
+                                 drop();
+                                 return dropped + out_data.size() < want;
+                             });
+
+    if (!parsed) {
+        if (hdr.init(out_data.data(), out_data.size())) {
+            out_data.erase(0, hdr.filedata_offset());
+        }
+        drop();
+    }
+    return ok;
+}
+
+
+// Queues a read of the first limit bytes of a subfile's compressed data.
+static void scheduleSubfile(IoScheduler& sched, GameArchive& game, const SubfileInfo& info,
+                            uint64_t limit, size_t index)
+{
+    unsigned archive = info._maybe_archiveIndex();
+    sched.add(game.datFile(archive), archive, info.fileOffset,
+              std::min(info.compressedSize, limit), index);
+}
+
+
+// Finds the subfile holding the ZOSFT file table by probing the MNF entries.
+static bool loadZOSFT(GameArchive& game, ZosftTable& table)
+{
+    std::string data;
+
+    for (uint32_t i : game.subfiles.offsetOrder()) {
+        SubfileInfo info = game.subfiles[i];
+        if (!probeSubfile(game, info, data) || data.compare(0, 5, "ZOSFT")) {
+            continue;
+        }
+        if (inflateSubfile(game, info, data) && table.init(std::move(data), &workerPool())) {
+            std::clog << "ZOSFT table: fileId " << info.fileId
+                      << ", " << table.recordCount() << " records" << std::endl;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static std::string ddsFormatName(const DDSHeader& dds)
+{
+    char tmp[40];
+    if (dds.dxgiFormat) {
+        snprintf(tmp, sizeof(tmp), "DX10/%u", dds.dxgiFormat);
+    }
+    else if (dds.hasFourCC()) {
+        snprintf(tmp, sizeof(tmp), "%.4s", dds.fourCC);
+    }
+    else {
+        snprintf(tmp, sizeof(tmp), "RGB%u", dds.rgbBitCount);
+    }
+    return tmp;
+}
+
+
+struct ProbeStats
+{
+    size_t      count;
+    uint64_t    compressedSize;
+    uint64_t    uncompressedSize;
+};
+
+
+static int cmdProbe()
+{
+    g_game.esodir = optEsoDir;
+    readMNF(g_game, false);
+
+    std::map<std::string, ProbeStats> inventory;
+    std::map<std::string, ProbeStats> ddsFormats;
+    std::string head;
+    size_t count = g_game.subfiles.size();
+    std::vector<std::string> types(count, "(error)");
+    std::vector<std::string> extras(count);
+    std::vector<std::string> formats(count);
+
+    // probe in archive order, so the archives are read sequentially
+    IoScheduler sched;
+    for (size_t i = 0; i < count; ++i) {
+        scheduleSubfile(sched, g_game, g_game.subfiles[i], PROBE_HEADER_LIMIT, i);
+    }
+    sched.plan();
+
+    for (size_t k = 0; k < sched.size(); ++k) {
+        size_t i = sched[k].index;
+        DDSHeader dds;
+        sched.prefetch(k);
+        if (probeSubfile(g_game, g_game.subfiles[i], head)) {
+            types[i] = filetypeHeuristics(head);
+            if (dds.init(ESOLittleEndianBuffer(head.data()), head.size())) {
+                char tmp[100];
+                formats[i] = ddsFormatName(dds);
+                snprintf(tmp, sizeof(tmp), "  %ux%u %s mips %u",
+                         dds.width, dds.height, formats[i].c_str(), dds.mipMapCount);
+                extras[i] = tmp;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        SubfileInfo info = g_game.subfiles[i];
+
+        if (!formats[i].empty()) {
+            ProbeStats& fs = ddsFormats[formats[i]];
+            fs.count++;
+            fs.compressedSize += info.compressedSize;
+            fs.uncompressedSize += info.uncompressedSize;
+        }
+
+        ProbeStats& ts = inventory[types[i]];
+        ts.count++;
+        ts.compressedSize += info.compressedSize;
+        ts.uncompressedSize += info.uncompressedSize;
+
+        char line[300];
+        snprintf(line, sizeof(line), "[%04lx] fileId %08x offset %08lx size %9lu / %9lu  %s%s",
+                 i, info.fileId, info.fileOffset, info.compressedSize,
+                 info.uncompressedSize, types[i].c_str(), extras[i].c_str());
+        std::cout << line << "\n";
+    }
+
+    const std::map<std::string, ProbeStats>* tables[] = { &inventory, &ddsFormats };
+    const char* titles[] = { "TYPE", "DDS FORMAT" };
+
+    for (int t = 0; t < 2; ++t) {
+        char line[300];
+        snprintf(line, sizeof(line), "\n%-20s %8s %14s %14s",
+                 titles[t], "COUNT", "COMPRESSED", "UNCOMPRESSED");
+        std::cout << line << "\n";
+        for (auto const& it : *tables[t]) {
+            snprintf(line, sizeof(line), "%-20s %8lu %14lu %14lu",
+                     it.first.c_str(), it.second.count,
+                     it.second.compressedSize, it.second.uncompressedSize);
+            std::cout << line << "\n";
+        }
+    }
+    std::cout << std::flush;
+    return 0;
+}
+
+
+static int cmdLookup()
+{
+    g_game.esodir = optEsoDir;
+    readMNF(g_game, false);
+
+    ZosftTable zosft;
+    if (!loadZOSFT(g_game, zosft)) {
+        throw std::runtime_error("ZOSFT file table not found");
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    size_t missing = 0;
+    size_t argi = 0;
+    std::string path;
+
+    while (g_args.empty() ? !!std::getline(std::cin, path) : argi < g_args.size()) {
+        if (!g_args.empty()) {
+            path = g_args[argi++];
+        }
+        const ZosftTable::Record* rec = zosft.find(path);
+        char tmp[20];
+        if (rec) {
+            snprintf(tmp, sizeof(tmp), "%08x", rec->fileId);
+        }
+        else {
+            snprintf(tmp, sizeof(tmp), "--------");
+            missing++;
+        }
+        std::cout << tmp << ' ' << path << '\n';
+    }
+
+    std::cout << std::flush;
+    return missing ? 1 : 0;
+}
+
+
+static int cmdVerifyNames()
+{
+    g_game.esodir = optEsoDir;
+    readMNF(g_game, false);
+
+    ZosftTable zosft;
+    if (!loadZOSFT(g_game, zosft)) {
+        throw std::runtime_error("ZOSFT file table not found");
+    }
+
+    ArrayView<ZosftTable::Record> recs = zosft.records();
+    size_t recordCount = recs.size();
+
+    // records are checked in parallel, each range into its own report
+    const size_t grain = 4096;
+    std::vector<std::string> reports((recordCount + grain - 1) / grain);
+    std::atomic<size_t> counts[5];
+    for (auto& c : counts) {
+        c = 0;
+    }
+
+    workerPool().parallelFor(recordCount, grain, [&](size_t begin, size_t end) {
+        std::string& report = reports[begin / grain];
+        for (size_t i = begin; i < end; ++i) {
+            const ZosftTable::Record& rec = recs[i];
+            ZosftTable::NameStatus st = zosft.nameStatus(i);
+            char tmp[400];
+            counts[st]++;
+            if (st == ZosftTable::NAME_MISMATCH) {
+                snprintf(tmp, sizeof(tmp), "[%04lx] fileId %08x hash %08x != %08x  %s\n",
+                         i, rec.fileId, rec.filenameHash, zosft.nameHash(i), zosft.filename(i));
+                report += tmp;
+            }
+            else if (st != ZosftTable::NAME_VERIFIED) {
+                snprintf(tmp, sizeof(tmp), "[%04lx] fileId %08x hash %08x  %s name at offset %08x\n",
+                         i, rec.fileId, rec.filenameHash,
+                         st == ZosftTable::NAME_MISSING ? "no" : "invalid", rec.filenameOffset);
+                report += tmp;
+            }
+            if (g_game.subfiles.findFileId(rec.fileId) == SubfileTable::npos) {
+                snprintf(tmp, sizeof(tmp), "[%04lx] fileId %08x not in MNF\n", i, rec.fileId);
+                report += tmp;
+                counts[4]++;
+            }
+        }
+    });
+
+    for (auto const& report : reports) {
+        std::cout << report;
+    }
+
+    size_t unnamed = 0;
+    for (uint32_t fileId : g_game.subfiles.fileIds()) {
+        if (!zosft.findFileId(fileId)) {
+            unnamed++;
+        }
+    }
+
+    std::cout << "records:          " << recordCount
+              << "\nverified:         " << counts[ZosftTable::NAME_VERIFIED]
+              << "\nhash mismatch:    " << counts[ZosftTable::NAME_MISMATCH]
+              << "\ninvalid name:     " << counts[ZosftTable::NAME_INVALID]
+              << "\nmissing name:     " << counts[ZosftTable::NAME_MISSING]
+              << "\nnot in MNF:       " << counts[4]
+              << "\nMNF unnamed:      " << unnamed << " of " << g_game.subfiles.size()
+              << std::endl;
+
+    return counts[ZosftTable::NAME_VERIFIED] == recordCount && counts[4] == 0 ? 0 : 1;
+}
+
+
+static bool is_text_type(const char* heur)
+{
+    return !strcmp(heur, "lua/.lua") || !strcmp(heur, "xml/.xml") || !strcmp(heur, "text/.txt");
+}
+
+
+typedef std::map<std::string, SubfileInfo> SubfileMap;
+
+// Keys subfiles by ZOSFT path, or by "#fileId" if they have no name.
+// When several subfiles share a name, the one with the lowest fileId
+// keeps it and the others are keyed by "#fileId" like unnamed ones.
+static void mapSubfiles(GameArchive& game, SubfileMap& entries)
+{
+    ZosftTable zosft;
+    bool named = loadZOSFT(game, zosft);
+
+    for (size_t i = 0; i < game.subfiles.size(); ++i) {
+        SubfileInfo info = game.subfiles[i];
+        const ZosftTable::Record* rec = (named ? zosft.findFileId(info.fileId) : NULL);
+        const char* fn = (rec ? zosft.filename(*rec) : NULL);
+        char tmp[20];
+        if (!fn) {
+            snprintf(tmp, sizeof(tmp), "#%08x", info.fileId);
+            entries.insert(std::make_pair(std::string(tmp), info));
+            continue;
+        }
+        auto ins = entries.insert(std::make_pair(std::string(fn), info));
+        if (ins.second || ins.first->second.fileId == info.fileId) {
+            continue;
+        }
+        SubfileInfo other = ins.first->second;
+        if (info.fileId < other.fileId) {
+            ins.first->second = info;
+            std::swap(info, other);
+        }
+        std::clog << "duplicate name " << fn << ": keeping fileId "
+                  << std::hex << other.fileId << ", keying " << info.fileId
+                  << std::dec << " by fileId" << std::endl;
+        snprintf(tmp, sizeof(tmp), "#%08x", info.fileId);
+        entries.insert(std::make_pair(std::string(tmp), info));
+    }
+}
+
+
+struct DiffEntry
+{
+    char                status;     // 'M', 'A' or 'D'
+    const std::string*  path;
+    const SubfileInfo*  oldInfo;
+    const SubfileInfo*  newInfo;
+    std::string         output;
+    bool                failed;     // not saved, or not diffed
+};
+
+
+// Inflates a changed entry and saves it and/or diffs it into e.output.
+static void inflateDiffEntry(GameArchive& oldGame, GameArchive& newGame, DiffEntry& e)
+{
+    std::string oldData, newData;
+    const char* heur = ".unk";
+
+    if (!optUnified && !optSaveSubfiles) {
+        return;
+    }
+
+    uint64_t oldSize = (e.oldInfo && optUnified ? e.oldInfo->uncompressedSize : 0);
+    uint64_t newSize = (e.newInfo ? e.newInfo->uncompressedSize : 0);
+    size_t window = streamWindow();
+    bool stored = (e.newInfo && isStoredSubfile(*e.newInfo));
+
+    if (std::max(oldSize, newSize) > window || (stored && !optUnified)) {
+        // too large to hold: only saved by streaming, and in unified mode
+        // reported like diff -q does, the manifest says it has changed.
+        // Stored subfiles need not be held to be saved either.
+        if (optSaveSubfiles && e.newInfo) {
+            std::string outfile = optOutDir;
+            outfile.append(!endswith(outfile, '/'), '/');
+            if ((*e.path)[0] == '#') {
+                if (probeSubfile(newGame, *e.newInfo, newData)) {
+                    heur = filetypeHeuristics(newData);
+                }
+                outfile.append(outputPathFromFileId(e.newInfo->fileId, heur));
+            }
+            else {
+                outfile.append(*e.path);
+            }
+            if (stored) {
+                if (!copyStoredSubfile(newGame, *e.newInfo, outfile)) {
+                    e.output = "copy failed for " + *e.path + "\n";
+                    e.failed = true;
+                    return;
+                }
+            }
+            else {
+                SubfileSink sink(outfile, window, e.newInfo->uncompressedSize);
+                if (!streamSubfile(newGame, *e.newInfo, sink)) {
+                    e.output = "inflate failed for " + *e.path + "\n";
+                    e.failed = true;
+                    return;
+                }
+            }
+        }
+        if (optUnified) {
+            e.output = "Files " + (e.oldInfo ? "a/" + *e.path : "/dev/null") +
+                       " and " + (e.newInfo ? "b/" + *e.path : "/dev/null") + " differ\n";
+        }
+        return;
+    }
+
+    MemoryBudget::Lease lease(g_budget, oldSize + newSize);
+
+    if (e.newInfo) {
+        if (!inflateSubfile(newGame, *e.newInfo, newData)) {
+            e.output = "inflate failed for " + *e.path + "\n";
+            e.failed = true;
+            return;
+        }
+        heur = filetypeHeuristics(newData);
+    }
+    if (optSaveSubfiles && e.newInfo) {
+        std::string outfile = optOutDir;
+        outfile.append(!endswith(outfile, '/'), '/');
+        if ((*e.path)[0] == '#') {
+            outfile.append(outputPathFromFileId(e.newInfo->fileId, heur));
+        }
+        else {
+            outfile.append(*e.path);
+        }
+        saveFile(outfile, newData);
+    }
+    if (!optUnified) {
+        return;
+    }
+    if (e.oldInfo) {
+        if (!inflateSubfile(oldGame, *e.oldInfo, oldData)) {
+            e.output = "inflate failed for " + *e.path + "\n";
+            e.failed = true;
+            return;
+        }
+        if (!e.newInfo) {
+            heur = filetypeHeuristics(oldData);
+        }
+    }
+
+    std::string labelA = (e.oldInfo ? "a/" + *e.path : "/dev/null");
+    std::string labelB = (e.newInfo ? "b/" + *e.path : "/dev/null");
+    std::ostringstream out;
+    if (is_text_type(heur)) {
+        UnifiedDiff(oldData, newData).write(out, labelA, labelB);
+    }
+    else if (oldData != newData) {
+        out << "Binary files " << labelA << " and " << labelB << " differ\n";
+    }
+    e.output = out.str();
+}
+
+
+// Compares two mapped installs and inflates the changed entries as the
+// options say, printing a line for each. The entries found are left in
+// changes, counted by status as modified, added and deleted.
+static void diffGames(GameArchive& oldGame, GameArchive& newGame,
+                      const SubfileMap& oldEntries, const SubfileMap& newEntries,
+                      std::vector<DiffEntry>& changes, size_t counts[3])
+{
+    // join both sorted maps by key, comparing only manifest metadata
+    auto oldIt = oldEntries.begin();
+    auto newIt = newEntries.begin();
+
+    while (oldIt != oldEntries.end() || newIt != newEntries.end()) {
+        DiffEntry e = DiffEntry();
+        if (newIt == newEntries.end() ||
+            (oldIt != oldEntries.end() && oldIt->first < newIt->first)) {
+            e.status = 'D';
+            e.path = &oldIt->first;
+            e.oldInfo = &(oldIt++)->second;
+        }
+        else if (oldIt == oldEntries.end() || newIt->first < oldIt->first) {
+            e.status = 'A';
+            e.path = &newIt->first;
+            e.newInfo = &(newIt++)->second;
+        }
+        else {
+            e.status = 'M';
+            e.path = &newIt->first;
+            e.oldInfo = &(oldIt++)->second;
+            e.newInfo = &(newIt++)->second;
+            if (e.oldInfo->_maybe_contentHash == e.newInfo->_maybe_contentHash &&
+                e.oldInfo->compressedSize == e.newInfo->compressedSize &&
+                e.oldInfo->uncompressedSize == e.newInfo->uncompressedSize) {
+                continue;
+            }
+        }
+        changes.push_back(std::move(e));
+    }
+
+    // inflate only the changed entries, in parallel batches; the output
+    // of each batch is printed in order before the next one starts. A
+    // quarter of the memory budget is set aside for that output.
+    const size_t batchSize = 256;
+    uint64_t outputBudget = g_budget.limit() / 4;
+    size_t window = streamWindow();
+    size_t batchEnd;
+
+    g_budget.setLimit(g_budget.limit() - outputBudget);
+    std::unique_ptr<uint64_t, void (*)(uint64_t*)> restoreBudget(&outputBudget, [](uint64_t* n) {
+        g_budget.setLimit(g_budget.limit() + *n);
+    });
+
+    for (size_t batch = 0; batch < changes.size(); batch = batchEnd) {
+        uint64_t batchOutput = 0;
+        for (batchEnd = batch; batchEnd < changes.size() && batchEnd - batch < batchSize; ++batchEnd) {
+            const DiffEntry& e = changes[batchEnd];
+            uint64_t oldSize = (e.oldInfo ? e.oldInfo->uncompressedSize : 0);
+            uint64_t newSize = (e.newInfo ? e.newInfo->uncompressedSize : 0);
+            uint64_t estimate = 100;
+            if (optUnified && std::max(oldSize, newSize) <= window) {
+                estimate += oldSize + newSize;
+            }
+            if (outputBudget && batchEnd > batch && batchOutput + estimate > outputBudget) {
+                break;
+            }
+            batchOutput += estimate;
+        }
+
+        // entries are inflated in the order of the archive they are read
+        // from first, the new one unless only in the old one; in unified
+        // mode the old data of modified entries is hinted alongside
+        IoScheduler sched, oldSched;
+        bool reads = (optUnified || optSaveSubfiles);
+        for (size_t i = 0; i < batchEnd - batch; ++i) {
+            const DiffEntry& e = changes[batch + i];
+            if (reads && e.newInfo) {
+                scheduleSubfile(sched, newGame, *e.newInfo, UINT64_MAX, i);
+                if (optUnified && e.oldInfo) {
+                    scheduleSubfile(oldSched, oldGame, *e.oldInfo, UINT64_MAX, i);
+                }
+            }
+            else if (reads && optUnified) {
+                scheduleSubfile(sched, oldGame, *e.oldInfo, UINT64_MAX, i);
+            }
+        }
+        sched.plan();
+        oldSched.plan();
+
+        std::vector<size_t> order;
+        for (size_t k = 0; k < sched.size(); ++k) {
+            order.push_back(sched[k].index);
+        }
+        for (size_t i = 0; i < batchEnd - batch; ++i) {
+            if (sched.position(i) == IoScheduler::npos) {
+                order.push_back(i);
+            }
+        }
+
+        workerPool().parallelFor(order.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                size_t i = order[k];
+                if (k < sched.size()) {
+                    sched.prefetch(k);
+                }
+                if (oldSched.position(i) != IoScheduler::npos) {
+                    oldSched.prefetch(oldSched.position(i));
+                }
+                DiffEntry& e = changes[batch + i];
+                try {
+                    inflateDiffEntry(oldGame, newGame, e);
+                }
+                catch (std::exception& ex) {
+                    e.output = std::string("error: ") + ex.what() + "\n";
+                    e.failed = true;
+                }
+            }
+        });
+
+        for (size_t i = batch; i < batchEnd; ++i) {
+            const DiffEntry& e = changes[i];
+            const SubfileInfo* oi = e.oldInfo;
+            const SubfileInfo* ni = e.newInfo;
+            char tmp[100];
+            snprintf(tmp, sizeof(tmp), "%c %9ld -> %9ld  ", e.status,
+                     oi ? (long)oi->uncompressedSize : -1, ni ? (long)ni->uncompressedSize : -1);
+            (optUnified ? std::clog : std::cout) << tmp << *e.path << "\n";
+            std::cout << e.output;
+            counts[e.status == 'M' ? 0 : e.status == 'A' ? 1 : 2]++;
+        }
+    }
+}
+
+
+static int cmdDiff()
+{
+    if (optOldDir.empty() || optNewDir.empty()) {
+        throw std::runtime_error("diff requires --old and --new");
+    }
+
+    GameArchive oldGame, newGame;
+    SubfileMap oldEntries, newEntries;
+
+    oldGame.esodir = optOldDir;
+    newGame.esodir = optNewDir;
+    readMNF(oldGame, false);
+    readMNF(newGame, false);
+    mapSubfiles(oldGame, oldEntries);
+    mapSubfiles(newGame, newEntries);
+
+    std::vector<DiffEntry> changes;
+    size_t counts[3] = { 0, 0, 0 };
+    diffGames(oldGame, newGame, oldEntries, newEntries, changes, counts);
+
+    std::cout << std::flush;
+    std::clog << counts[0] << " modified, " << counts[1] << " added, "
+              << counts[2] << " deleted" << std::endl;
+    return 0;
+}
+
+
+// Keeps the tree under --outdir in step with an install that is patched
+// in place. The tree is taken to match the install when watching starts.
+// After each change to game.mnf or a .dat file, once the patcher has been
+// quiet for a while, the manifest is compared with the previous one as
+// diff does; changed subfiles are saved and deleted ones removed.
+static int cmdWatch()
+{
+    if (!optSaveSubfiles) {
+        throw std::runtime_error("watch requires --save");
+    }
+    // the old data is overwritten by the patch, there is nothing to diff
+    optUnified = false;
+
+    std::unique_ptr<GameArchive> game(new GameArchive);
+    SubfileMap entries;
+    game->esodir = optEsoDir;
+    readMNF(*game, false);
+    mapSubfiles(*game, entries);
+
+    std::string dir = optEsoDir + "/game/client";
+    std::string outdir = optOutDir;
+    outdir.append(!endswith(outdir, '/'), '/');
+
+    DirWatcher watcher(dir);
+    std::set<std::string> changed;
+    auto isArchive = [](const std::string& name) {
+        return name == "game.mnf" ||
+               (name.size() > 4 && !name.compare(name.size() - 4, 4, ".dat"));
+    };
+
+    std::clog << "watching " << dir << " with " << entries.size() << " subfiles" << std::endl;
+
+    while (watcher.wait(isArchive, 2000, changed)) {
+        try {
+            std::unique_ptr<GameArchive> newGame(new GameArchive);
+            SubfileMap newEntries;
+            newGame->esodir = optEsoDir;
+            readMNF(*newGame, false);
+            mapSubfiles(*newGame, newEntries);
+
+            std::vector<DiffEntry> changes;
+            size_t counts[3] = { 0, 0, 0 };
+            diffGames(*game, *newGame, entries, newEntries, changes, counts);
+
+            // unnamed subfiles were saved under their heuristic, which is
+            // not known any more; they are left behind. Entries that
+            // failed, likely read while the patcher was still writing,
+            // keep their old state so that the next round retries them.
+            std::vector<std::string> retry;
+            for (const DiffEntry& e : changes) {
+                if (e.status == 'D' && (*e.path)[0] != '#') {
+                    ::unlink((outdir + *e.path).c_str());
+                }
+                if (e.failed && e.status == 'M') {
+                    newEntries[*e.path] = *e.oldInfo;
+                }
+                else if (e.failed && e.status == 'A') {
+                    retry.push_back(*e.path);
+                }
+            }
+            for (const std::string& path : retry) {
+                newEntries.erase(path);
+            }
+
+            std::cout << std::flush;
+            std::clog << counts[0] << " modified, " << counts[1] << " added, "
+                      << counts[2] << " deleted";
+            if (size_t failed = std::count_if(changes.begin(), changes.end(),
+                                              [](const DiffEntry& e) { return e.failed; })) {
+                std::clog << ", " << failed << " failed and left for the next change";
+            }
+            std::clog << std::endl;
+
+            game.swap(newGame);
+            entries.swap(newEntries);
+        }
+        catch (std::exception& e) {
+            std::cerr << "error: " << e.what() << ", waiting for the next change" << std::endl;
+        }
+    }
+
+    std::clog << "stopped watching " << dir << std::endl;
+    return 0;
+}
+
+
+// Cheap test of a scan candidate before the full inflate: the stream must
+// decode its first bytes, or end within in_len, without error.
+static bool is_plausible_stream(const char* in_ptr, size_t in_len)
+{
+    char buf[PROBE_PAYLOAD_SIZE];
+    size_t out_len = sizeof(buf);
+    return inflatePrefix(in_ptr, in_len, buf, &out_len);
+}
+
+
+// Decoded output of a stream found by the scan, kept so that extracting
+// the stream does not inflate it a second time. Kept output counts against
+// g_scanKept, a share set aside from g_budget, until it is dropped.
+static MemoryBudget g_scanKept;
+
+struct ScanOutput
+{
+    std::string     data;
+    uint64_t        leased;
+
+    ScanOutput()
+      : leased(0) {}
+
+    ~ScanOutput()
+    {
+        g_scanKept.release(leased);
+    }
+
+    // accounts for n bytes of data; false if they would not fit
+    bool reserve(uint64_t n)
+    {
+        if (n <= leased) {
+            return true;
+        }
+        uint64_t more = std::max<uint64_t>(n - leased, leased);
+        if (!g_scanKept.tryAcquire(more)) {
+            return false;
+        }
+        leased += more;
+        return true;
+    }
+};
+
+
+// Compressed length of the zlib stream at in_ptr, or 0 unless it is a
+// complete stream within in_len bytes. The output is kept in *output if
+// the budgets allow, else it is discarded.
+static size_t streamLength(const char* in_ptr, size_t in_len,
+                           std::shared_ptr<ScanOutput>* output)
+{
+    char buf[0x8000];
+    size_t length = 0;
+    std::shared_ptr<ScanOutput> keep = std::make_shared<ScanOutput>();
+    z_stream zs;
+    zs.next_in = (const Bytef*)in_ptr;
+    zs.avail_in = 0;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+
+    if (inflateInit(&zs) != Z_OK) {
+        return 0;
+    }
+
+    int zerr;
+    do {
+        zs.next_out = (Bytef*)buf;
+        zs.avail_out = sizeof(buf);
+        refillInput(zs, in_len);
+        zerr = inflate(&zs, Z_NO_FLUSH);
+        size_t out_len = zs.next_out - (Bytef*)buf;
+        if (keep && out_len > 0) {
+            if (keep->reserve(keep->data.size() + out_len)) {
+                keep->data.append(buf, out_len);
+            }
+            else {
+                keep.reset();
+            }
+        }
+    } while (zerr == Z_OK);
+
+    if (zerr == Z_STREAM_END) {
+        length = zs.total_in;
+        output->swap(keep);
+    }
+    inflateEnd(&zs);
+    return length;
+}
+
+
+static const size_t SCAN_CHUNK_SIZE = 4 << 20;
+
+// A stream to extract: where it starts and how many bytes it may take,
+// and its output if the scan kept it.
+struct ScanHit
+{
+    size_t      offset;
+    size_t      length;
+    std::shared_ptr<ScanOutput> output;
+};
+
+
+// A piece of a scan range, scanned by its own thread as if the serial scan
+// had entered it at its first byte. Every candidate looked at on the way
+// is remembered, with length 0 if it is no complete stream.
+struct ScanChunk
+{
+    size_t                  range;
+    size_t                  begin;
+    size_t                  end;
+    size_t                  rangeEnd;
+    size_t                  stop;       // where the chunk's own scan left off
+    std::vector<ScanHit>    memo;
+};
+
+
+static void scanChunk(const FileMapping& dat, ScanChunk& c)
+{
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(dat.data());
+    size_t pos = c.begin;
+
+    while (pos < c.end && pos + 2 <= c.rangeEnd) {
+        if (!is_zlib_header(data + pos)) {
+            ++pos;
+            continue;
+        }
+        ScanHit h = { pos, 0, std::shared_ptr<ScanOutput>() };
+        if (is_plausible_stream(dat.data() + pos, c.rangeEnd - pos)) {
+            h.length = streamLength(dat.data() + pos, c.rangeEnd - pos, &h.output);
+        }
+        c.memo.push_back(h);
+        pos += (h.length ? h.length : 1);
+    }
+    c.stop = pos;
+}
+
+
+// Scans the ranges for zlib streams, each of which must lie completely
+// inside its range, and appends them to hits. Ranges are split into
+// chunks that are scanned in parallel; the chunks are then stitched
+// together in order so that the result is exactly that of a serial scan.
+static void scanRanges(const FileMapping& dat, const std::vector<ScanHit>& ranges,
+                       std::vector<ScanHit>& hits)
+{
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(dat.data());
+    std::vector<ScanChunk> chunks;
+
+    for (size_t ri = 0; ri < ranges.size(); ++ri) {
+        size_t rangeEnd = ranges[ri].offset + ranges[ri].length;
+        for (size_t begin = ranges[ri].offset; begin < rangeEnd; begin += SCAN_CHUNK_SIZE) {
+            ScanChunk c = ScanChunk();
+            c.range = ri;
+            c.begin = begin;
+            c.end = std::min(rangeEnd, begin + SCAN_CHUNK_SIZE);
+            c.rangeEnd = rangeEnd;
+            chunks.push_back(std::move(c));
+        }
+    }
+
+    workerPool().parallelFor(chunks.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            scanChunk(dat, chunks[i]);
+        }
+    });
+
+    size_t pos = 0;
+
+    for (size_t ci = 0; ci < chunks.size(); ++ci) {
+        ScanChunk& c = chunks[ci];
+        if (ci == 0 || c.range != chunks[ci - 1].range) {
+            pos = c.begin;
+        }
+        if (pos >= c.end) {
+            // covered by a stream starting in an earlier chunk
+            continue;
+        }
+
+        // Walk on serially from pos until reaching a position the chunk's
+        // own scan has been at; from there on both agree. Only candidates
+        // hidden inside a stream that the serial scan does not take have to
+        // be looked at here.
+        auto it = std::lower_bound(c.memo.begin(), c.memo.end(), pos,
+                                   [](const ScanHit& h, size_t p) { return h.offset < p; });
+        bool synced = (pos == c.begin);
+
+        while (!synced && pos < c.end && pos + 2 <= c.rangeEnd) {
+            while (it != c.memo.end() && it->offset < pos) {
+                ++it;
+            }
+            if (it != c.memo.end() && it->offset == pos) {
+                synced = true;
+                break;
+            }
+            if (!is_zlib_header(data + pos)) {
+                ++pos;
+                continue;
+            }
+            ScanHit h = { pos, 0, std::shared_ptr<ScanOutput>() };
+            if (is_plausible_stream(dat.data() + pos, c.rangeEnd - pos)) {
+                h.length = streamLength(dat.data() + pos, c.rangeEnd - pos, &h.output);
+            }
+            if (h.length) {
+                hits.push_back(h);
+            }
+            pos += (h.length ? h.length : 1);
+        }
+
+        if (synced) {
+            for (; it != c.memo.end(); ++it) {
+                if (it->length) {
+                    hits.push_back(*it);
+                }
+            }
+            pos = c.stop;
+        }
+        // the output of candidates the serial scan does not take is dropped
+        c.memo.clear();
+    }
+}
+
+
+static void reportStream(ExtractedStream& x)
+{
+    if (!x.consumed) {
+        std::cerr << x.error << std::endl;
+        return;
+    }
+
+    g_fileOffsets.push_back(x.offset);
+    g_heuristicsResults.push_back(x.heuristic ? x.heuristic : "");
+    g_outputPaths.push_back(outputPathFromOffset(x.offset, ".raw"));
+    g_streamTags.push_back(std::vector<TagEntry>());
+    g_streamTags.back().swap(x.tags);
+    g_streamTagLanguages.push_back(x.tagLanguage);
+
+    char line[200];
+    snprintf(line, sizeof(line),
+             "[%04lx] extracted file from offset %08lx ( %08lx %08lx %08lx ) heuristics: %s",
+             g_fileOffsets.size() - 1,
+             x.offset, x.offset - 14,
+             x.offset + x.headerSize,
+             x.offset - 14 + x.headerSize,
+             x.heuristic ? x.heuristic : "null");
+    std::cout << line << std::endl;
+
+    if (!x.zosft.empty()) {
+        // the largest buffers of an unpack, accounted while it is dumped
+        ZosftTable table;
+        if (table.init(std::move(x.zosft), &workerPool(), &g_budget)) {
+            dumpZOSFT(table);
+            renameExtracted(optOutDir, table);
+        }
+        else {
+            std::cout << "ZOSFT dump\nfile table is truncated or corrupt" << std::endl;
+        }
+        std::cout << std::endl;
+    }
+}
+
+
+// "#fileId" as used for unnamed subfiles, or "0xfileId"
+static bool parseFileId(const std::string& name, uint32_t* fileId)
+{
+    const char* digits = name.c_str();
+    if (startswith(digits, "#")) {
+        digits += 1;
+    }
+    else if (startswith(digits, "0x")) {
+        digits += 2;
+    }
+    else {
+        return false;
+    }
+    char* end;
+    unsigned long v = std::strtoul(digits, &end, 16);
+    if (end == digits || *end != '\0' || v > UINT32_MAX) {
+        return false;
+    }
+    *fileId = v;
+    return true;
+}
+
+
+// MNF row of the subfile named by a ZOSFT path or a fileId, or npos.
+static size_t resolveSubfile(const GameArchive& game, const ZosftTable* zosft,
+                             const std::string& name)
+{
+    uint32_t fileId;
+    if (parseFileId(name, &fileId)) {
+        return game.subfiles.findFileId(fileId);
+    }
+    const ZosftTable::Record* rec = (zosft ? zosft->find(name) : NULL);
+    return rec ? game.subfiles.findFileId(rec->fileId) : SubfileTable::npos;
+}
+
+
+// Extracts one subfile by the index to outfile, or only inflates it if
+// there is none. Stored subfiles are copied.
+static bool extractSubfile(GameArchive& game, const SubfileInfo& info,
+                           const std::string& outfile, size_t window)
+{
+    if (isStoredSubfile(info)) {
+        return outfile.empty() || copyStoredSubfile(game, info, outfile);
+    }
+    SubfileSink sink(outfile, window, info.uncompressedSize);
+    return streamSubfile(game, info, sink);
+}
+
+
+struct ListJob
+{
+    size_t          row;
+    std::string     outfile;
+    bool            ok;
+};
+
+
+// Extracts only the subfiles listed in the --from-list file, one per line.
+// The tables are parsed once for the whole list and each subfile named
+// more than once is extracted once, all in archive order.
+static int extractList()
+{
+    g_game.esodir = optEsoDir;
+    readMNF(g_game, false);
+
+    ZosftTable zosft;
+    bool named = loadZOSFT(g_game, zosft);
+
+    std::ifstream file;
+    std::istream* in = &std::cin;
+    if (optFromList != "-") {
+        file.open(optFromList.c_str());
+        if (!file) {
+            throw std::runtime_error("failed to open " + optFromList);
+        }
+        in = &file;
+    }
+
+    std::vector<std::string> lines;
+    std::vector<size_t> lineJobs;
+    std::vector<ListJob> jobs;
+    std::map<size_t, size_t> rowJobs;
+    std::string line;
+
+    while (std::getline(*in, line)) {
+        if (endswith(line, '\r')) {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty()) {
+            continue;
+        }
+        size_t row = resolveSubfile(g_game, named ? &zosft : NULL, line);
+        size_t job = SubfileTable::npos;
+        if (row != SubfileTable::npos) {
+            auto ins = rowJobs.insert(std::make_pair(row, jobs.size()));
+            if (ins.second) {
+                ListJob j = { row, std::string(), false };
+                jobs.push_back(j);
+            }
+            job = ins.first->second;
+        }
+        lines.push_back(line);
+        lineJobs.push_back(job);
+    }
+
+    IoScheduler sched;
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        scheduleSubfile(sched, g_game, g_game.subfiles[jobs[j].row], UINT64_MAX, j);
+    }
+    sched.plan();
+
+    size_t window = streamWindow();
+
+    workerPool().parallelFor(sched.size(), 1, [&](size_t begin, size_t end) {
+        std::string head;
+        for (size_t k = begin; k < end; ++k) {
+            ListJob& job = jobs[sched[k].index];
+            SubfileInfo info = g_game.subfiles[job.row];
+            const ZosftTable::Record* rec = (named ? zosft.findFileId(info.fileId) : NULL);
+            const char* fn = (rec ? zosft.filename(*rec) : NULL);
+
+            sched.prefetch(k);
+            job.outfile = optOutDir;
+            job.outfile.append(!endswith(job.outfile, '/'), '/');
+            if (fn) {
+                job.outfile.append(fn);
+            }
+            else {
+                const char* heur = ".unk";
+                if (probeSubfile(g_game, info, head)) {
+                    heur = filetypeHeuristics(head);
+                }
+                job.outfile.append(outputPathFromFileId(info.fileId, heur));
+            }
+
+            job.ok = extractSubfile(g_game, info, job.outfile, window);
+        }
+    });
+
+    size_t missing = 0;
+    size_t failed = 0;
+
+    for (size_t i = 0; i < lines.size(); ++i) {
+        char tmp[20];
+        if (lineJobs[i] == SubfileTable::npos) {
+            std::cout << "-------- " << lines[i] << '\n';
+            missing++;
+            continue;
+        }
+        const ListJob& job = jobs[lineJobs[i]];
+        if (!job.ok) {
+            std::cerr << "inflate failed for " << lines[i] << std::endl;
+            failed++;
+            continue;
+        }
+        snprintf(tmp, sizeof(tmp), "%08x", g_game.subfiles[job.row].fileId);
+        std::cout << tmp << ' ' << job.outfile << '\n';
+    }
+
+    size_t extracted = std::count_if(jobs.begin(), jobs.end(),
+                                     [](const ListJob& j) { return j.ok; });
+    std::cout << std::flush;
+    std::clog << "extracted " << extracted << " subfiles for " << lines.size()
+              << " lines, " << missing << " not found" << std::endl;
+    return missing || failed ? 1 : 0;
+}
+
+
+// Writes the --tags file for the streams unpack extracted, as ctags -R
+// over the output directory would, with absolute paths. The tags were
+// collected while the payloads were in memory; files that were not, or
+// whose final name has another language than their heuristic, are read
+// back from the output directory.
+static void writeUnpackTags()
+{
+    char* real = realpath(optOutDir.c_str(), NULL);
+    std::string outdir = (real ? real : optOutDir);
+    outdir.append(!endswith(outdir, '/'), '/');
+    free(real);
+
+    size_t count = g_outputPaths.size();
+    std::vector<std::vector<std::string>> streamLines(count);
+
+    workerPool().parallelFor(count, 16, [&](size_t begin, size_t end) {
+        std::vector<TagEntry> tags;
+        for (size_t i = begin; i < end; ++i) {
+            std::string path = outdir + g_outputPaths[i];
+            int lang = g_tagRules->language(path);
+            const std::vector<TagEntry>* found = &g_streamTags[i];
+            if (lang < 0) {
+                continue;
+            }
+            if (lang != g_streamTagLanguages[i]) {
+                if (!optSaveSubfiles || ::access(path.c_str(), R_OK) != 0) {
+                    continue;
+                }
+                FileMapping fr(path.c_str());
+                tags.clear();
+                tagScanner().scan(lang, fr.data(), fr.size(), tags);
+                found = &tags;
+            }
+            for (const TagEntry& tag : *found) {
+                streamLines[i].push_back(tag.line(path));
+            }
+        }
+    });
+
+    std::vector<std::string> lines;
+    for (std::vector<std::string>& sl : streamLines) {
+        std::move(sl.begin(), sl.end(), std::back_inserter(lines));
+    }
+    writeTagFile(optTags, lines);
+    std::clog << "wrote " << lines.size() << " tags to " << optTags << std::endl;
+}
+
+
+// Adds the *.mnf files under dir and its subdirectories to found.
+static void findManifests(const std::string& dir, std::vector<std::string>& found)
+{
+    DIR* d = ::opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    std::vector<std::string> subdirs;
+    while (struct dirent* ent = ::readdir(d)) {
+        std::string name = ent->d_name;
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (name == "." || name == ".." || ::lstat(path.c_str(), &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            subdirs.push_back(path);
+        }
+        else if (S_ISREG(st.st_mode) && name.size() > 4 &&
+                 !name.compare(name.size() - 4, 4, ".mnf")) {
+            found.push_back(path);
+        }
+    }
+    ::closedir(d);
+    for (const std::string& sub : subdirs) {
+        findManifests(sub, found);
+    }
+}
+
+
+struct Manifest
+{
+    GameArchive     game;
+    ZosftTable      zosft;
+    bool            named;
+    std::string     outdir;
+};
+
+struct ManifestJob
+{
+    Manifest*       manifest;
+    size_t          row;
+    std::string     outfile;
+    bool            ok;
+};
+
+
+// Extracts every manifest found under --esodir, each into the directory
+// of --outdir named after its path without .mnf, so game/client/game/ for
+// game/client/game.mnf. The manifests are read one after the other; then
+// all their subfiles are extracted in one schedule over all archives, on
+// the shared worker pool.
+static int cmdUnpackAll()
+{
+    std::vector<std::string> paths;
+    findManifests(optEsoDir, paths);
+    std::sort(paths.begin(), paths.end());
+    if (paths.empty()) {
+        throw std::runtime_error("no manifests found under " + optEsoDir);
+    }
+
+    std::vector<std::unique_ptr<Manifest>> manifests;
+    std::vector<ManifestJob> jobs;
+    std::string outdir = optOutDir;
+    outdir.append(!endswith(outdir, '/'), '/');
+
+    for (const std::string& path : paths) {
+        std::unique_ptr<Manifest> m(new Manifest);
+        m->game.esodir = optEsoDir;
+        m->game.mnfFile = path;
+        try {
+            readMNF(m->game, false);
+        }
+        catch (std::exception& e) {
+            std::cerr << "error: " << e.what() << std::endl;
+            continue;
+        }
+        m->named = loadZOSFT(m->game, m->zosft);
+        std::string rel = path.substr(optEsoDir.size());
+        rel.erase(0, rel.find_first_not_of('/'));
+        m->outdir = outdir + rel.substr(0, rel.size() - 4) + "/";
+
+        for (size_t i = 0; i < m->game.subfiles.size(); ++i) {
+            ManifestJob job = { m.get(), i, std::string(), false };
+            jobs.push_back(job);
+        }
+        std::clog << path << ": " << m->game.subfiles.size() << " subfiles" << std::endl;
+        manifests.push_back(std::move(m));
+    }
+
+    IoScheduler sched;
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        GameArchive& game = jobs[j].manifest->game;
+        scheduleSubfile(sched, game, game.subfiles[jobs[j].row], UINT64_MAX, j);
+    }
+    sched.plan();
+
+    size_t window = streamWindow();
+
+    workerPool().parallelFor(sched.size(), 1, [&](size_t begin, size_t end) {
+        std::string head;
+        for (size_t k = begin; k < end; ++k) {
+            ManifestJob& job = jobs[sched[k].index];
+            Manifest& m = *job.manifest;
+            SubfileInfo info = m.game.subfiles[job.row];
+
+            sched.prefetch(k);
+            if (optSaveSubfiles) {
+                const ZosftTable::Record* rec = (m.named ? m.zosft.findFileId(info.fileId) : NULL);
+                const char* fn = (rec ? m.zosft.filename(*rec) : NULL);
+                job.outfile = m.outdir;
+                if (fn) {
+                    job.outfile.append(fn);
+                }
+                else {
+                    const char* heur = ".unk";
+                    if (probeSubfile(m.game, info, head)) {
+                        heur = filetypeHeuristics(head);
+                    }
+                    job.outfile.append(outputPathFromFileId(info.fileId, heur));
+                }
+            }
+            job.ok = extractSubfile(m.game, info, job.outfile, window);
+        }
+    });
+
+    size_t failed = 0;
+    for (const ManifestJob& job : jobs) {
+        char tmp[20];
+        snprintf(tmp, sizeof(tmp), "%08x ", job.manifest->game.subfiles.fileIds()[job.row]);
+        if (!job.ok) {
+            std::cerr << "inflate failed for " << tmp << "of "
+                      << job.manifest->game.mnfPath() << std::endl;
+            failed++;
+            continue;
+        }
+        std::cout << tmp << (job.outfile.empty() ? "-" : job.outfile) << '\n';
+    }
+
+    std::cout << std::flush;
+    std::clog << "extracted " << jobs.size() - failed << " subfiles of " << manifests.size()
+              << " manifests, " << failed << " failed" << std::endl;
+    return failed || manifests.size() < paths.size() ? 1 : 0;
+}
+
+
+static int cmdUnpack()
+{
+    if (!optFromList.empty()) {
+        return extractList();
+    }
+
+    if (optResume && !optSaveSubfiles) {
+        throw std::runtime_error("--resume requires --save");
+    }
+    if (!optTags.empty()) {
+        g_tagRules.reset(new TagRules(optTagsOptions));
+    }
+
+    g_game.esodir = optEsoDir;
+    bool haveMNF = false;
+
+    try {
+        readMNF(g_game);
+        haveMNF = true;
+    }
+    catch (std::exception& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+    }
+
+    try {
+        const FileMapping& dat = g_game.datFile(0);
+        size_t size = dat.size();
+
+        // the spans of the first archive known from the manifest are
+        // inflated where they start; only the gaps between them are
+        // scanned for streams
+        std::vector<ScanHit> spans;
+        std::map<size_t, uint32_t> storedRows;
+        const SubfileTable& subfiles = g_game.subfiles;
+        for (uint32_t i : subfiles.offsetOrder()) {
+            uint64_t offset = subfiles.fileOffsets()[i];
+            uint64_t compressedSize = subfiles.compressedSizes()[i];
+            if (!haveMNF || subfiles.archiveIndex(i) != 0) {
+                break;
+            }
+            if (offset < size && compressedSize > 0) {
+                ScanHit h = { offset, std::min<size_t>(compressedSize, size - offset),
+                              std::shared_ptr<ScanOutput>() };
+                spans.push_back(h);
+                if (isStoredSubfile(subfiles[i])) {
+                    storedRows[offset] = i;
+                }
+            }
+        }
+        if (haveMNF) {
+            std::clog << "scanning gaps between " << spans.size() << " known subfiles" << std::endl;
+        }
+
+        std::vector<ScanHit> gaps;
+        std::vector<ScanHit> streams;
+        size_t pos = 0;
+        for (auto const& span : spans) {
+            if (span.offset < pos) {
+                // overlaps the previous one, or a duplicate
+                continue;
+            }
+            if (pos < span.offset) {
+                ScanHit gap = { pos, span.offset - pos, std::shared_ptr<ScanOutput>() };
+                gaps.push_back(gap);
+            }
+            pos = span.offset + span.length;
+            if (storedRows.count(span.offset)) {
+                // copied as it is, it need not start like a zlib stream
+                streams.push_back(span);
+            }
+            else if (span.offset + 2 <= size &&
+                is_zlib_header(reinterpret_cast<const unsigned char*>(dat.data()) + span.offset)) {
+                ScanHit h = { span.offset, size - span.offset, std::shared_ptr<ScanOutput>() };
+                streams.push_back(h);
+            }
+            else {
+                std::clog << "skipping subfile at " << span.offset
+                          << ", not a zlib stream" << std::endl;
+            }
+        }
+        if (pos < size) {
+            ScanHit gap = { pos, size - pos, std::shared_ptr<ScanOutput>() };
+            gaps.push_back(gap);
+        }
+
+        // the scan keeps decoded streams within a share of the budget
+        // that extraction does without
+        uint64_t keptBudget = g_budget.limit() / 8;
+        g_scanKept.setLimit(keptBudget ? keptBudget : streamWindow());
+        g_budget.setLimit(g_budget.limit() - keptBudget);
+
+        scanRanges(dat, gaps, streams);
+        std::sort(streams.begin(), streams.end(),
+                  [](const ScanHit& a, const ScanHit& b) { return a.offset < b.offset; });
+
+        // saved streams are journaled, so that --resume can skip them
+        // if the run is cut short; the journal is removed once it is done
+        std::unique_ptr<Journal> journal;
+        if (optSaveSubfiles) {
+            std::string path = optOutDir;
+            path.append(!endswith(path, '/'), '/');
+            path.append(".eso-unpack.journal");
+            make_path(&path[0]);
+            journal.reset(new Journal(path, optResume, archiveIdentity(g_game)));
+            if (optResume) {
+                std::clog << "resuming after " << journal->size() << " journaled streams" << std::endl;
+            }
+        }
+
+        // inflate in parallel batches; each batch is reported in archive
+        // order before the next one starts
+        const size_t batchSize = 256;
+        std::vector<ExtractedStream> batch;
+        std::vector<bool> resumed;
+
+        for (size_t first = 0; first < streams.size(); first += batchSize) {
+            size_t count = std::min(batchSize, streams.size() - first);
+            batch.assign(count, ExtractedStream());
+            resumed.assign(count, false);
+
+            // a stream reads at most up to where the next one starts
+            IoScheduler sched;
+            for (size_t i = 0; i < count; ++i) {
+                const ScanHit& h = streams[first + i];
+                const std::string* entry = (journal ? journal->find(h.offset) : NULL);
+                batch[i].offset = h.offset;
+                if (entry && resumeStream(*entry, batch[i])) {
+                    resumed[i] = true;
+                    streams[first + i].output.reset();
+                    continue;
+                }
+                uint64_t next = (first + i + 1 < streams.size() ? streams[first + i + 1].offset : size);
+                sched.add(dat, 0, h.offset, std::min<uint64_t>(h.length, next - h.offset), i);
+            }
+            sched.plan();
+
+            workerPool().parallelFor(sched.size(), 1, [&](size_t begin, size_t end) {
+                for (size_t k = begin; k < end; ++k) {
+                    size_t i = sched[k].index;
+                    ScanHit& h = streams[first + i];
+                    auto stored = storedRows.find(h.offset);
+                    if (stored != storedRows.end()) {
+                        copyStoredStream(optOutDir, subfiles[stored->second], batch[i]);
+                        continue;
+                    }
+                    if (h.output) {
+                        extractStream(optOutDir, dat.data() + h.offset, h.length, batch[i],
+                                      &h.output->data);
+                        h.output.reset();
+                        continue;
+                    }
+                    sched.prefetch(k);
+                    extractStream(optOutDir, dat.data() + h.offset, h.length, batch[i]);
                 }
+            });
+
+            for (size_t i = 0; i < count; ++i) {
+                ExtractedStream& x = batch[i];
+                // the file table is inflated again on every run, the
+                // names are taken from it
+                bool table = !x.zosft.empty();
+                reportStream(x);
+                if (journal && x.consumed && !table && !resumed[i]) {
+                    journal->add(x.offset, journalEntry(x));
+                }
+            }
+            if (journal) {
+                journal->commit(optOutDir);
             }
         }
+        g_budget.setLimit(g_budget.limit() + keptBudget);
+        if (journal) {
+            journal->remove();
+        }
+
+        if (g_tagRules) {
+            writeUnpackTags();
+        }
     }
     catch (std::exception& e) {
         std::cerr << "error: " << e.what() << std::endl;
@@ -798,3 +2988,847 @@ int main(int argc, char** argv)
 
     return 0;
 }
+
+
+// Consumes count bytes of a sequential input; false if it ends first.
+static bool skipInput(TBuffer<char>& in, uint64_t count)
+{
+    while (count) {
+        size_t avail;
+        char* data;
+        in.next(std::min<uint64_t>(count, STREAM_CHUNK_SIZE), &avail, &data);
+        if (!avail) {
+            return false;
+        }
+        in.consume(avail);
+        count -= avail;
+    }
+    return true;
+}
+
+
+// Inflates a subfile from a sequential input into the sink, or copies it
+// if it is stored. The input must be at the start of the subfile, and is
+// left at its end.
+static bool streamFromInput(TBuffer<char>& in, const SubfileInfo& info, SubfileSink& sink)
+{
+    uint64_t left = info.compressedSize;
+    size_t avail;
+    char* data;
+
+    // decided by the sizes alone: a pipe may hand over the first bytes
+    // one at a time
+    if (isStoredSubfile(info)) {
+        while (left) {
+            in.next(std::min<uint64_t>(left, STREAM_CHUNK_SIZE), &avail, &data);
+            if (!avail) {
+                return false;
+            }
+            sink.write(data, avail);
+            in.consume(avail);
+            left -= avail;
+        }
+        sink.finish();
+        return true;
+    }
+
+    z_stream zs;
+    zs.next_in = Z_NULL;
+    zs.avail_in = 0;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+
+    if (inflateInit(&zs) != Z_OK) {
+        return false;
+    }
+
+    // ensure inflateEnd(zs) gets called upon exception / return
+    std::unique_ptr<z_stream, int (&)(z_streamp)> zsGuard(&zs, inflateEnd);
+
+    int zerr = Z_OK;
+    while (zerr != Z_STREAM_END) {
+        in.next(std::min<uint64_t>(left, STREAM_CHUNK_SIZE), &avail, &data);
+        if (!avail) {
+            return false;
+        }
+        zs.next_in = (const Bytef*)data;
+        zs.avail_in = avail;
+        zs.next_out = (Bytef*)sink.chunk();
+        zs.avail_out = STREAM_CHUNK_SIZE;
+
+        zerr = inflate(&zs, Z_NO_FLUSH);
+        size_t used = avail - zs.avail_in;
+        size_t out_len = STREAM_CHUNK_SIZE - zs.avail_out;
+        in.consume(used);
+        left -= used;
+        if (out_len) {
+            sink.write(sink.chunk(), out_len);
+        }
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            return false;
+        }
+    }
+
+    zsGuard.reset();
+    sink.finish();
+    return skipInput(in, left);
+}
+
+
+// Unpacks the first archive read front to back from --dat, which may be a
+// pipe or - for stdin; --mnf may be a pipe as well. Subfiles are extracted
+// in the order they arrive, holding no more than one subfile's stream
+// window. Until the ZOSFT file table has come by they are named by fileId
+// and heuristics, and renamed once it has.
+static int cmdStream()
+{
+    if (optDat.empty()) {
+        throw std::runtime_error("stream requires --dat");
+    }
+
+    g_game.esodir = optEsoDir;
+    g_game.mnfFile = optMnf;
+    readMNF(g_game, false);
+
+    File input;
+    if (optDat == "-") {
+        input.reset(::dup(0));
+    }
+    else {
+        input.open(optDat, O_RDONLY);
+    }
+    TBuffer<char> in(4 * STREAM_CHUNK_SIZE, input);
+
+    std::string outdir = optOutDir;
+    outdir.append(!endswith(outdir, '/'), '/');
+
+    const SubfileTable& subfiles = g_game.subfiles;
+    ZosftTable zosft;
+    bool named = false;
+    std::vector<std::pair<uint32_t, std::string>> unnamed;
+    size_t extracted = 0;
+    size_t failed = 0;
+    size_t skipped = 0;
+    char tmp[100];
+
+    for (uint32_t i : subfiles.offsetOrder()) {
+        SubfileInfo info = subfiles[i];
+        if (info._maybe_archiveIndex() != 0) {
+            break;
+        }
+        if (info.fileOffset < in.offset()) {
+            // overlaps the previous subfile, its data has passed
+            snprintf(tmp, sizeof(tmp), "skipping fileId %08x at %08lx, already passed",
+                     info.fileId, (unsigned long)info.fileOffset);
+            std::clog << tmp << std::endl;
+            skipped++;
+            continue;
+        }
+        if (!skipInput(in, info.fileOffset - in.offset())) {
+            std::cerr << "input ended at offset " << in.offset() << std::endl;
+            failed++;
+            break;
+        }
+
+        const ZosftTable::Record* rec = (named ? zosft.findFileId(info.fileId) : NULL);
+        const char* fn = (rec ? zosft.filename(*rec) : NULL);
+        std::string outfile;
+        if (optSaveSubfiles) {
+            outfile = outdir + (fn ? std::string(fn) : outputPathFromFileId(info.fileId, ".raw"));
+        }
+
+        uint64_t start = in.offset();
+        SubfileSink sink(outfile, streamWindow(), info.uncompressedSize);
+        if (!streamFromInput(in, info, sink)) {
+            snprintf(tmp, sizeof(tmp), "inflate failed for fileId %08x at %08lx",
+                     info.fileId, (unsigned long)info.fileOffset);
+            std::cerr << tmp << std::endl;
+            failed++;
+            if (in.offset() < start + info.compressedSize &&
+                !skipInput(in, start + info.compressedSize - in.offset())) {
+                break;
+            }
+            continue;
+        }
+        extracted++;
+
+        if (!fn && optSaveSubfiles) {
+            std::string path = outdir + outputPathFromFileId(info.fileId,
+                                                             filetypeHeuristics(sink.data()));
+            make_path(&path[0]);
+            ::rename(outfile.c_str(), path.c_str());
+            outfile = path;
+            unnamed.push_back(std::make_pair(info.fileId, outfile));
+        }
+        snprintf(tmp, sizeof(tmp), "%08x ", info.fileId);
+        std::cout << tmp << (outfile.empty() ? "-" : outfile) << '\n';
+
+        std::string& data = sink.data();
+        if (!named && !data.compare(0, 5, "ZOSFT") && data.size() >= 5 &&
+            !data.compare(data.size() - 5, 5, "ZOSFT")) {
+            named = zosft.init(std::move(data), &workerPool());
+            for (size_t u = 0; named && u < unnamed.size(); ++u) {
+                const ZosftTable::Record* r = zosft.findFileId(unnamed[u].first);
+                if (r) {
+                    std::string path = outdir + zosft.filename(*r);
+                    std::clog << "renaming " << unnamed[u].second << " to " << path
+                              << " (ZOSFT filename)" << std::endl;
+                    make_path(&path[0]);
+                    ::rename(unnamed[u].second.c_str(), path.c_str());
+                }
+            }
+            unnamed.clear();
+        }
+    }
+
+    std::cout << std::flush;
+    std::clog << "streamed " << extracted << " subfiles from " << in.offset() << " bytes, "
+              << failed << " failed, " << skipped << " skipped" << std::endl;
+    return failed ? 1 : 0;
+}
+
+
+// Candidate algorithms for the MNF content hash; the one in use is told
+// apart by trying them all on the first subfiles.
+enum ContentHash
+{
+    HASH_CRC32,
+    HASH_ADLER32,
+    HASH_CRC32_COMPRESSED,
+    HASH_COUNT,
+};
+
+static const char* const g_contentHashNames[HASH_COUNT] = {
+    "crc32",
+    "adler32",
+    "crc32 of compressed data",
+};
+
+static const size_t HASH_SAMPLE_SIZE = 16;
+
+
+struct VerifyResult
+{
+    uint64_t        inflated;
+    uint32_t        hashes[HASH_COUNT];
+    std::string     error;
+};
+
+
+static uint32_t crc32Long(uint32_t crc, const char* data, size_t len)
+{
+    for (size_t pos = 0; pos < len; ) {
+        uInt n = zlibCount(len - pos);
+        crc = crc32(crc, (const Bytef*)data + pos, n);
+        pos += n;
+    }
+    return crc;
+}
+
+
+static uint32_t adler32Long(uint32_t adler, const char* data, size_t len)
+{
+    for (size_t pos = 0; pos < len; ) {
+        uInt n = zlibCount(len - pos);
+        adler = adler32(adler, (const Bytef*)data + pos, n);
+        pos += n;
+    }
+    return adler;
+}
+
+
+// Inflates a subfile without keeping any of it. zlib checks the Adler-32
+// at the end of the stream; the inflated size is checked against the MNF.
+// The content hash candidates in mask are computed along the way. Stored
+// subfiles are only hashed.
+static void verifySubfile(GameArchive& game, const SubfileInfo& info, unsigned mask,
+                          std::vector<char>& chunk, VerifyResult& res)
+{
+    const FileMapping& dat = game.datFile(info._maybe_archiveIndex());
+
+    res.inflated = 0;
+    res.hashes[HASH_CRC32] = crc32(0, Z_NULL, 0);
+    res.hashes[HASH_ADLER32] = adler32(0, Z_NULL, 0);
+    res.hashes[HASH_CRC32_COMPRESSED] = crc32(0, Z_NULL, 0);
+
+    if (info.fileOffset + info.compressedSize > uint64_t(dat.size())) {
+        res.error = "extends past the end of the archive";
+        return;
+    }
+
+    const char* in_ptr = dat.data() + info.fileOffset;
+    size_t in_len = info.compressedSize;
+
+    if (isStoredSubfile(info)) {
+        for (int h = 0; h < HASH_COUNT; ++h) {
+            if (mask & (1u << h)) {
+                res.hashes[h] = (h == HASH_ADLER32 ? adler32Long(res.hashes[h], in_ptr, in_len) :
+                                 crc32Long(res.hashes[h], in_ptr, in_len));
+            }
+        }
+        res.inflated = in_len;
+        return;
+    }
+    if (mask & (1u << HASH_CRC32_COMPRESSED)) {
+        res.hashes[HASH_CRC32_COMPRESSED] = crc32Long(res.hashes[HASH_CRC32_COMPRESSED],
+                                                      in_ptr, in_len);
+    }
+    if (in_len < 2 || !is_zlib_header(reinterpret_cast<const unsigned char*>(in_ptr))) {
+        res.error = "not a zlib stream, and the sizes differ";
+        return;
+    }
+
+    z_stream zs;
+    zs.next_in = (const Bytef*)in_ptr;
+    zs.avail_in = 0;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+
+    if (inflateInit(&zs) != Z_OK) {
+        res.error = "zlib init failed";
+        return;
+    }
+
+    int zerr;
+    do {
+        zs.next_out = (Bytef*)chunk.data();
+        zs.avail_out = chunk.size();
+        refillInput(zs, in_len);
+        zerr = inflate(&zs, Z_NO_FLUSH);
+
+        uInt n = zs.next_out - (Bytef*)chunk.data();
+        res.inflated += n;
+        if (mask & (1u << HASH_CRC32)) {
+            res.hashes[HASH_CRC32] = crc32(res.hashes[HASH_CRC32], (Bytef*)chunk.data(), n);
+        }
+        if (mask & (1u << HASH_ADLER32)) {
+            res.hashes[HASH_ADLER32] = adler32(res.hashes[HASH_ADLER32], (Bytef*)chunk.data(), n);
+        }
+    } while (zerr == Z_OK);
+
+    if (zerr == Z_BUF_ERROR) {
+        res.error = "stream truncated";
+    }
+    else if (zerr != Z_STREAM_END) {
+        res.error = std::string("zlib: ") + (zs.msg ? zs.msg : "inflate failed");
+    }
+    else if (res.inflated != info.uncompressedSize) {
+        char tmp[80];
+        snprintf(tmp, sizeof(tmp), "inflated to %lu bytes, MNF says %lu",
+                 (unsigned long)res.inflated, (unsigned long)info.uncompressedSize);
+        res.error = tmp;
+    }
+    inflateEnd(&zs);
+}
+
+
+// Inflates every subfile of the MNF on all cores and writes nothing,
+// reporting the subfiles that fail a check and the throughput.
+static int cmdVerify()
+{
+    g_game.esodir = optEsoDir;
+    readMNF(g_game, false);
+
+    const SubfileTable& subfiles = g_game.subfiles;
+    size_t count = subfiles.size();
+
+    IoScheduler sched;
+    for (size_t i = 0; i < count; ++i) {
+        scheduleSubfile(sched, g_game, subfiles[i], UINT64_MAX, i);
+    }
+    sched.plan();
+
+    // a candidate hash is taken if it matches on every sampled subfile
+    std::vector<char> chunk(STREAM_CHUNK_SIZE);
+    unsigned candidates = (1u << HASH_COUNT) - 1;
+    size_t sampled = 0;
+
+    for (size_t k = 0; k < sched.size() && sampled < HASH_SAMPLE_SIZE && candidates; ++k) {
+        SubfileInfo info = subfiles[sched[k].index];
+        VerifyResult res;
+        verifySubfile(g_game, info, candidates, chunk, res);
+        if (!res.error.empty()) {
+            continue;
+        }
+        for (int h = 0; h < HASH_COUNT; ++h) {
+            if (res.hashes[h] != info._maybe_contentHash) {
+                candidates &= ~(1u << h);
+            }
+        }
+        sampled++;
+    }
+
+    int algo = -1;
+    for (int h = 0; h < HASH_COUNT && sampled && algo < 0; ++h) {
+        if (candidates & (1u << h)) {
+            algo = h;
+        }
+    }
+
+    std::vector<std::string> errors(count);
+    std::atomic<uint64_t> compressedBytes(0);
+    std::atomic<uint64_t> inflatedBytes(0);
+    std::atomic<size_t> failed(0);
+    auto start = std::chrono::steady_clock::now();
+
+    workerPool().parallelFor(sched.size(), 16, [&](size_t begin, size_t end) {
+        MemoryBudget::Lease lease(g_budget, STREAM_CHUNK_SIZE);
+        std::vector<char> chunk(STREAM_CHUNK_SIZE);
+        for (size_t k = begin; k < end; ++k) {
+            size_t i = sched[k].index;
+            SubfileInfo info = subfiles[i];
+            VerifyResult res;
+
+            sched.prefetch(k);
+            verifySubfile(g_game, info, algo < 0 ? 0 : 1u << algo, chunk, res);
+            if (res.error.empty() && algo >= 0 && res.hashes[algo] != info._maybe_contentHash) {
+                char tmp[60];
+                snprintf(tmp, sizeof(tmp), "content hash %08x != %08x",
+                         res.hashes[algo], info._maybe_contentHash);
+                res.error = tmp;
+            }
+            compressedBytes += info.compressedSize;
+            inflatedBytes += res.inflated;
+            if (!res.error.empty()) {
+                errors[i].swap(res.error);
+                failed++;
+            }
+        }
+    });
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (size_t i = 0; i < count; ++i) {
+        if (!errors[i].empty()) {
+            SubfileInfo info = subfiles[i];
+            char tmp[100];
+            snprintf(tmp, sizeof(tmp), "[%04lx] fileId %08x offset %08lx  ",
+                     i, info.fileId, (unsigned long)info.fileOffset);
+            std::cout << tmp << errors[i] << "\n";
+        }
+    }
+
+    char tmp[200];
+    double mb = 1024 * 1024;
+    std::cout << "subfiles:         " << count
+              << "\nfailed:           " << failed
+              << "\ncontent hash:     " << (algo < 0 ? "unknown, not checked" : g_contentHashNames[algo]);
+    snprintf(tmp, sizeof(tmp),
+             "\nthroughput:       %.1f MiB in, %.1f MiB out in %.3f s, %.1f MiB/s in, %.1f MiB/s out",
+             compressedBytes / mb, inflatedBytes / mb, secs,
+             secs > 0 ? compressedBytes / mb / secs : 0.0,
+             secs > 0 ? inflatedBytes / mb / secs : 0.0);
+    std::cout << tmp << std::endl;
+
+    return failed ? 1 : 0;
+}
+
+
+// Inflate checkpoints of a subfile too large to cache, and where its
+// payload starts.
+struct SubfileIndex
+{
+    InflateIndex    index;
+    size_t          headerSize;
+
+    size_t size() const
+    {
+        return index.size();
+    }
+};
+
+
+// Answers the requests of the serve command from one archive set, with
+// the payloads of recently read subfiles in an LRU cache. Range reads of
+// subfiles too large for it resume from checkpoints taken every span
+// bytes, kept in a second cache of a quarter of the size.
+class ArchiveService
+{
+public:
+
+    ArchiveService(GameArchive& game, uint64_t cacheSize, uint64_t span)
+      : _game(game)
+      , _cache(cacheSize)
+      , _indexes(cacheSize / 4)
+      , _span(span)
+    {
+        _named = loadZOSFT(game, _zosft);
+
+        for (size_t i = 0; i < game.subfiles.size(); ++i) {
+            SubfileInfo info = game.subfiles[i];
+            const ZosftTable::Record* rec = (_named ? _zosft.findFileId(info.fileId) : NULL);
+            const char* fn = (rec ? _zosft.filename(*rec) : NULL);
+            char tmp[20];
+            if (!fn) {
+                snprintf(tmp, sizeof(tmp), "#%08x", info.fileId);
+                fn = tmp;
+            }
+            _names.push_back(std::make_pair(std::string(fn), i));
+        }
+        std::sort(_names.begin(), _names.end());
+    }
+
+    void handle(const std::string& request, std::string& response,
+                std::unique_ptr<MemoryBudget::Lease>& lease)
+    {
+        size_t sp = request.find(' ');
+        std::string verb = request.substr(0, sp);
+        std::string arg = (sp == std::string::npos ? std::string() : request.substr(sp + 1));
+
+        if (verb == "list") {
+            list(arg, response);
+        }
+        else if (verb == "stat") {
+            stat(arg, response);
+        }
+        else if (verb == "read") {
+            read(arg, 0, UINT64_MAX, response, lease);
+        }
+        else if (verb == "read-range") {
+            // the name may contain spaces, the numbers are the last words
+            size_t sp2 = arg.rfind(' ');
+            size_t sp1 = (sp2 == std::string::npos || sp2 == 0 ?
+                          std::string::npos : arg.rfind(' ', sp2 - 1));
+            unsigned long offset, length;
+            if (sp1 == std::string::npos ||
+                !parsenum(arg.substr(sp1 + 1, sp2 - sp1 - 1).c_str(), &offset) ||
+                !parsenum(arg.substr(sp2 + 1).c_str(), &length)) {
+                error("usage: read-range NAME OFFSET LENGTH", response);
+                return;
+            }
+            read(arg.substr(0, sp1), offset, length, response, lease);
+        }
+        else {
+            error("unknown request: " + verb, response);
+        }
+    }
+
+    const LruCache<size_t>& cache() const
+    {
+        return _cache;
+    }
+
+    const LruCache<size_t, SubfileIndex>& indexes() const
+    {
+        return _indexes;
+    }
+
+private:
+
+    typedef LruCache<size_t>::Value Value;
+
+    static const size_t OK_SIZE = 32;    // "OK <length>\n"
+
+    static void ok(const char* data, size_t len, std::string& response)
+    {
+        char tmp[OK_SIZE];
+        snprintf(tmp, sizeof(tmp), "OK %zu\n", len);
+        response.reserve(strlen(tmp) + len);
+        response.append(tmp).append(data, len);
+    }
+
+    static void error(const std::string& message, std::string& response)
+    {
+        response = "ERR " + message + "\n";
+    }
+
+    // fileId, uncompressed size and name of every subfile whose name
+    // starts with prefix, in name order
+    void list(const std::string& prefix, std::string& response)
+    {
+        std::string out;
+        auto it = std::lower_bound(_names.begin(), _names.end(),
+                                   std::make_pair(prefix, size_t(0)));
+        for (; it != _names.end() && !it->first.compare(0, prefix.size(), prefix); ++it) {
+            char tmp[40];
+            snprintf(tmp, sizeof(tmp), "%08x %lu ",
+                     _game.subfiles[it->second].fileId,
+                     (unsigned long)_game.subfiles[it->second].uncompressedSize);
+            out.append(tmp).append(it->first).append(1, '\n');
+        }
+        ok(out.data(), out.size(), response);
+    }
+
+    void stat(const std::string& name, std::string& response)
+    {
+        size_t row = resolveSubfile(_game, _named ? &_zosft : NULL, name);
+        if (row == SubfileTable::npos) {
+            error("not found: " + name, response);
+            return;
+        }
+        SubfileInfo info = _game.subfiles[row];
+        char tmp[200];
+        int len = snprintf(tmp, sizeof(tmp),
+                           "fileId %08x\narchive %u\noffset %lu\n"
+                           "compressed %lu\nuncompressed %lu\n",
+                           info.fileId, info._maybe_archiveIndex(),
+                           (unsigned long)info.fileOffset,
+                           (unsigned long)info.compressedSize,
+                           (unsigned long)info.uncompressedSize);
+        ok(tmp, len, response);
+    }
+
+    // Sends length bytes of the payload from offset on, fewer at its end.
+    // Subfiles that fit into the cache are inflated whole and cached;
+    // larger ones are read through their checkpoints, or without those
+    // only as much as the range needs is inflated. The buffers are charged
+    // to one lease taken up front, which is left covering the response
+    // until it is sent; a read they could never fit is refused.
+    void read(const std::string& name, uint64_t offset, uint64_t length, std::string& response,
+              std::unique_ptr<MemoryBudget::Lease>& lease)
+    {
+        size_t row = resolveSubfile(_game, _named ? &_zosft : NULL, name);
+        if (row == SubfileTable::npos) {
+            error("not found: " + name, response);
+            return;
+        }
+
+        SubfileInfo info = _game.subfiles[row];
+        uint64_t end = (length > UINT64_MAX - offset ? UINT64_MAX : offset + length);
+
+        const char* stored;
+        uint64_t storedLen;
+        if (isStoredSubfile(info) && storedPayload(_game, info, &stored, &storedLen)) {
+            // served from the mapping, there is nothing to inflate or cache
+            offset = std::min(offset, storedLen);
+            length = std::min(length, storedLen - offset);
+            if (!charge(name, OK_SIZE + length, response, lease)) {
+                return;
+            }
+            ok(stored + offset, length, response);
+            return;
+        }
+
+        // the payload is at most as long as the subfile
+        uint64_t most = OK_SIZE + std::min(length, info.uncompressedSize);
+        if (_span && info.uncompressedSize > _cache.limit()) {
+            if (charge(name, most, response, lease)) {
+                readIndexed(name, row, offset, length, response);
+                lease->shrink(response.capacity());
+            }
+            return;
+        }
+
+        Value data = _cache.get(row);
+        // a range of a subfile that is not cached is inflated into a
+        // buffer of its own, past the chunks before it
+        bool whole = (info.uncompressedSize <= _cache.limit());
+        uint64_t need = most;
+        if (!data) {
+            need += (whole ? info.uncompressedSize :
+                     std::min(info.uncompressedSize, length + 2 * STREAM_CHUNK_SIZE));
+        }
+        if (!charge(name, need, response, lease)) {
+            return;
+        }
+        if (!data) {
+            std::shared_ptr<std::string> buf = std::make_shared<std::string>();
+            bool inflated = (whole ? inflateSubfile(_game, info, *buf) :
+                             inflateSubfilePrefix(_game, info, end, *buf, offset));
+            if (!inflated) {
+                error("inflate failed: " + name, response);
+                lease.reset();
+                return;
+            }
+            data = buf;
+            if (whole) {
+                _cache.put(row, data);
+            }
+            else {
+                offset = 0;
+            }
+        }
+
+        offset = std::min<uint64_t>(offset, data->size());
+        length = std::min<uint64_t>(length, data->size() - offset);
+        ok(data->data() + offset, length, response);
+        // a cached buffer is accounted by the cache from here on
+        data.reset();
+        lease->shrink(response.capacity());
+    }
+
+    // Takes a lease on n bytes for the buffers of a read, or refuses the
+    // read if the budget could never give that many.
+    bool charge(const std::string& name, uint64_t n, std::string& response,
+                std::unique_ptr<MemoryBudget::Lease>& lease)
+    {
+        if (g_budget.limit() && n > g_budget.limit()) {
+            error("too large for --max-memory: " + name, response);
+            return false;
+        }
+        lease.reset(new MemoryBudget::Lease(g_budget, n));
+        return true;
+    }
+
+    // A range read through the subfile's checkpoints. The first one takes
+    // a full inflate pass to build them.
+    void readIndexed(const std::string& name, size_t row, uint64_t offset, uint64_t length,
+                     std::string& response)
+    {
+        SubfileInfo info = _game.subfiles[row];
+        const FileMapping& dat = _game.datFile(info._maybe_archiveIndex());
+        if (info.fileOffset >= uint64_t(dat.size())) {
+            error("inflate failed: " + name, response);
+            return;
+        }
+        const char* in_ptr = dat.data() + info.fileOffset;
+        size_t in_len = std::min<uint64_t>(info.compressedSize, dat.size() - info.fileOffset);
+
+        std::shared_ptr<const SubfileIndex> idx = _indexes.get(row);
+        if (!idx) {
+            std::shared_ptr<SubfileIndex> built = std::make_shared<SubfileIndex>();
+            std::string head(std::min<uint64_t>(PROBE_HEADER_LIMIT, info.uncompressedSize), '\0');
+            size_t head_len = head.size();
+            ESOSubfileHeader<const char> hdr;
+            if (!built->index.build(in_ptr, in_len, _span) ||
+                !built->index.read(in_ptr, in_len, 0, &head[0], &head_len)) {
+                error("inflate failed: " + name, response);
+                return;
+            }
+            built->headerSize = (hdr.init(head.data(), head_len) ? hdr.filedata_offset() : 0);
+            idx = built;
+            _indexes.put(row, idx);
+        }
+
+        uint64_t payload = idx->index.length() - std::min<uint64_t>(idx->headerSize, idx->index.length());
+        offset = std::min(offset, payload);
+        length = std::min(length, payload - offset);
+
+        // read in place behind the header, which is fixed up if the read
+        // comes out shorter
+        char tmp[OK_SIZE];
+        size_t hdr_len = snprintf(tmp, sizeof(tmp), "OK %zu\n", size_t(length));
+        response.assign(tmp, hdr_len);
+        response.resize(hdr_len + length);
+        size_t len = length;
+        if (!idx->index.read(in_ptr, in_len, idx->headerSize + offset, &response[hdr_len], &len)) {
+            error("inflate failed: " + name, response);
+            return;
+        }
+        if (len < length) {
+            std::string data = response.substr(hdr_len, len);
+            response.clear();
+            ok(data.data(), len, response);
+        }
+    }
+
+    GameArchive&                                    _game;
+    ZosftTable                                      _zosft;
+    bool                                            _named;
+    std::vector<std::pair<std::string, size_t>>     _names;
+    LruCache<size_t>                                _cache;
+    LruCache<size_t, SubfileIndex>                  _indexes;
+    uint64_t                                        _span;
+};
+
+
+// Serves subfiles over a Unix domain socket until interrupted. Requests
+// are single lines, subfiles are named by ZOSFT path or #fileId:
+//
+//   list [PREFIX]                      fileId, size and name per line
+//   stat NAME                          MNF entry fields
+//   read NAME                          the payload
+//   read-range NAME OFFSET LENGTH      part of the payload
+//
+// Each response is "OK <length>\n" followed by that many bytes, or a
+// single "ERR <message>\n" line.
+static int cmdServe()
+{
+    g_game.esodir = optEsoDir;
+    readMNF(g_game, false);
+
+    ArchiveService service(g_game, optCacheSize, optCheckpointSpan);
+    SocketServer server(optSocket);
+
+    std::clog << "serving " << g_game.subfiles.size() << " subfiles on "
+              << optSocket << std::endl;
+
+    server.run(workerPool(), [&service](const std::string& request, std::string& response,
+                                         std::unique_ptr<MemoryBudget::Lease>& lease) {
+        service.handle(request, response, lease);
+    });
+
+    const LruCache<size_t>& cache = service.cache();
+    std::clog << "served " << server.requests() << " requests, cache "
+              << cache.hits() << " hits, " << cache.misses() << " misses, "
+              << cache.size() << " of " << cache.limit() << " bytes used, checkpoints "
+              << service.indexes().size() << " bytes" << std::endl;
+    return 0;
+}
+
+
+struct cmd_t
+{
+    const char*     name;
+    int             (*func)();
+};
+
+
+static cmd_t g_cmds[] = {
+    { "unpack", cmdUnpack },
+    { "probe", cmdProbe },
+    { "lookup", cmdLookup },
+    { "verify-names", cmdVerifyNames },
+    { "diff", cmdDiff },
+    { "serve", cmdServe },
+    { "verify", cmdVerify },
+    { "stream", cmdStream },
+    { "watch", cmdWatch },
+    { "unpack-all", cmdUnpackAll },
+    { NULL, NULL }, // guard
+};
+
+
+int main(int argc, char** argv)
+{
+    try {
+        int res = parseopts(argc, argv);
+        if (res)
+            return res;
+    }
+    catch (std::exception& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    for (const cmd_t* cmd = g_cmds; cmd->name; ++cmd) {
+        if (optCommand == cmd->name) {
+            try {
+                if (!optStoreDir.empty()) {
+                    g_store.reset(new ContentStore(optStoreDir));
+                }
+                if (optMaxMemory && optMaxMemory < 2 * STREAM_MIN_WINDOW) {
+                    // a sink's first lease must fit after the shares
+                    // set aside for scan and diff output
+                    std::ostringstream err;
+                    err << "--max-memory must be at least " << 2 * STREAM_MIN_WINDOW / 1024 << " KiB";
+                    throw std::runtime_error(err.str());
+                }
+                g_budget.setLimit(optMaxMemory);
+                int res = cmd->func();
+                if (g_store) {
+                    std::clog << "store: " << g_store->objects() << " objects written ("
+                              << g_store->bytesWritten() << " bytes), "
+                              << g_store->hits() << " duplicates linked ("
+                              << g_store->bytesSaved() << " bytes saved)" << std::endl;
+                }
+                std::clog << "peak RSS: " << peakRSS() / 1024 << " KiB";
+                if (optMaxMemory) {
+                    std::clog << ", buffers " << g_budget.peak() / 1024 << " KiB of "
+                              << optMaxMemory / 1024 << " KiB budget";
+                }
+                std::clog << std::endl;
+                return res;
+            }
+            catch (std::exception& e) {
+                std::cerr << "error: " << e.what() << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    std::cerr << "unknown command: " << optCommand << std::endl;
+    return 2;
+}
@@ -29,13 +29,22 @@
 #ifndef ESOUNPACK_FILEIO_H
 #define ESOUNPACK_FILEIO_H
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -90,6 +99,13 @@ public:
         }
     }
 
+    // takes over an already open descriptor
+    void reset(int fd)
+    {
+        close();
+        _fd = fd;
+    }
+
     ssize_t read(void* buf, size_t count)
     {
         ssize_t n;
@@ -114,8 +130,71 @@ public:
         return n;
     }
 
+    // Appends length bytes of src_fd from offset on, without passing them
+    // through user space where the kernel can help: a reflink if the
+    // filesystem shares extents, else copy_file_range, else sendfile.
+    void copyFrom(int src_fd, uint64_t offset, uint64_t length)
+    {
+        off_t pos = ::lseek(_fd, 0, SEEK_CUR);
+        struct file_clone_range fcr;
+        fcr.src_fd = src_fd;
+        fcr.src_offset = offset;
+        fcr.src_length = length;
+        fcr.dest_offset = pos;
+        if (length && pos != -1 && ::ioctl(_fd, FICLONERANGE, &fcr) == 0) {
+            ::lseek(_fd, pos + length, SEEK_SET);
+            return;
+        }
+
+        bool kernelCopy = true;
+        bool useSendfile = false;
+        while (length) {
+            size_t count = std::min<uint64_t>(length, 1 << 30);
+            ssize_t n = -1;
+            if (kernelCopy && !useSendfile) {
+                loff_t in_off = offset;
+                n = ::copy_file_range(src_fd, &in_off, _fd, NULL, count, 0);
+                if (n < 0 && s_unsupported(errno)) {
+                    useSendfile = true;
+                    continue;
+                }
+            }
+            else if (kernelCopy) {
+                off_t in_off = offset;
+                n = ::sendfile(_fd, src_fd, &in_off, count);
+                if (n < 0 && s_unsupported(errno)) {
+                    kernelCopy = false;
+                    continue;
+                }
+            }
+            else {
+                char buf[1 << 16];
+                n = ::pread(src_fd, buf, std::min(count, sizeof(buf)), offset);
+                if (n > 0) {
+                    for (ssize_t done = 0; done < n; ) {
+                        done += write(buf + done, n - done);
+                    }
+                }
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::runtime_error(n < 0 ? "error copying file data" :
+                                                 "unexpected end of file");
+            }
+            offset += n;
+            length -= n;
+        }
+    }
+
 private:
 
+    static bool s_unsupported(int err)
+    {
+        return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP;
+    }
+
     static int s_open(const char* path, int flags, int mode)
     {
         int fd = ::open(path, flags, mode);
@@ -130,6 +209,111 @@ private:
 };
 
 
+// An output file that only appears under its path once it is complete.
+// It is written unnamed through O_TMPFILE where the file system supports
+// that, else under a temporary name next to path, and preallocated to the
+// expected size. commit() publishes it, replacing any file at path; if it
+// is dropped before, nothing is left behind (or a temporary after a crash).
+class AtomicFile
+{
+public:
+
+    AtomicFile(const std::string& path, uint64_t size = 0)
+      : _path(path)
+      , _committed(false)
+    {
+        size_t slash = path.rfind('/');
+        std::string dir = (slash == std::string::npos ? "." : path.substr(0, slash + 1));
+
+        // unnamed files are linked through /proc; readable, so that they
+        // can still be copied to a name if that fails
+        int fd = (procFdUsable() ? ::open(dir.c_str(), O_TMPFILE | O_RDWR, 0644) : -1);
+        if (fd != -1) {
+            _file.reset(fd);
+        }
+        else {
+            _tmpPath = tmpName();
+            _file.open(_tmpPath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        }
+
+        if (size) {
+            // keeps large outputs in few extents; not all file systems can
+            ::fallocate(_file.fd(), 0, 0, size);
+        }
+    }
+
+    ~AtomicFile()
+    {
+        if (!_committed && !_tmpPath.empty()) {
+            ::unlink(_tmpPath.c_str());
+        }
+    }
+
+    File& file()
+    {
+        return _file;
+    }
+
+    // cuts off what was preallocated but not written, and links the file
+    // under its path
+    void commit()
+    {
+        off_t end = ::lseek(_file.fd(), 0, SEEK_CUR);
+        if (end == -1 || ::ftruncate(_file.fd(), end) != 0) {
+            throw std::runtime_error("failed to finish " + _path);
+        }
+
+        if (_tmpPath.empty()) {
+            char proc[64];
+            snprintf(proc, sizeof(proc), "/proc/self/fd/%d", _file.fd());
+            if (::linkat(AT_FDCWD, proc, AT_FDCWD, _path.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+                _committed = true;
+                _file.close();
+                return;
+            }
+            // replace the old file in one step, through a temporary name;
+            // where the file cannot be linked, it is copied to that name
+            std::string tmpPath = tmpName();
+            if (errno != EEXIST ||
+                ::linkat(AT_FDCWD, proc, AT_FDCWD, tmpPath.c_str(), AT_SYMLINK_FOLLOW) != 0) {
+                File named(tmpPath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+                _tmpPath = tmpPath;
+                named.copyFrom(_file.fd(), 0, end);
+            }
+            _tmpPath = tmpPath;
+        }
+
+        _file.close();
+        if (::rename(_tmpPath.c_str(), _path.c_str()) != 0) {
+            throw std::runtime_error("failed to rename to " + _path);
+        }
+        _committed = true;
+    }
+
+private:
+
+    static bool procFdUsable()
+    {
+        static bool usable = (::access("/proc/self/fd", F_OK) == 0);
+        return usable;
+    }
+
+    // a name in the directory of path, unique within the process
+    std::string tmpName() const
+    {
+        static std::atomic<unsigned> counter(0);
+        char tmp[64];
+        snprintf(tmp, sizeof(tmp), ".tmp-%d-%u", int(::getpid()), unsigned(counter++));
+        size_t slash = _path.rfind('/');
+        return (slash == std::string::npos ? "" : _path.substr(0, slash + 1)) + tmp;
+    }
+
+    std::string     _path;
+    std::string     _tmpPath;
+    File            _file;
+    bool            _committed;
+};
+
 class FileMapping
 {
 public:
@@ -147,16 +331,39 @@ public:
         check(fd, fd != -1);
         check(fd, ::fstat(fd, &st) != -1);
 
+        if (uint64_t(st.st_size) > SIZE_MAX) {
+            errno = EFBIG;
+            check(fd, false);
+        }
+
         _size = st.st_size;
-        _data = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-        check(fd, _data != NULL);
+        _data = NULL;
+        _mapped = false;
+        if (!S_ISREG(st.st_mode)) {
+            // a pipe or device cannot be mapped, it is read whole
+            readAll(fd);
+        }
+        else if (_size > 0) {
+            _data = ::mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            check(fd, _data != MAP_FAILED);
+            _mapped = true;
+        }
 
-        ::close(fd);
+        // kept open for copying ranges of the file in the kernel
+        _fd = fd;
     }
 
     ~FileMapping()
     {
-        ::munmap(_data, _size);
+        if (_mapped) {
+            ::munmap(_data, _size);
+        }
+        ::close(_fd);
+    }
+
+    int fd() const
+    {
+        return _fd;
     }
 
     char* data() const
@@ -174,8 +381,34 @@ public:
         return _size;
     }
 
+    // asks the kernel to read the range into the page cache in the
+    // background; the mapping is all that is left of the file
+    void willNeed(uint64_t offset, uint64_t length) const
+    {
+        if (!_mapped || offset >= uint64_t(_size)) {
+            return;
+        }
+        length = std::min(length, uint64_t(_size) - offset);
+        uint64_t begin = offset & ~uint64_t(::sysconf(_SC_PAGESIZE) - 1);
+        ::madvise(data() + begin, offset + length - begin, MADV_WILLNEED);
+    }
+
 private:
 
+    void readAll(int fd)
+    {
+        ssize_t n;
+        do {
+            size_t used = _buffer.size();
+            _buffer.resize(std::max<size_t>(used * 2, 1 << 16));
+            while ((n = ::read(fd, &_buffer[used], _buffer.size() - used)) < 0 && errno == EINTR) {}
+            check(fd, n >= 0);
+            _buffer.resize(used + n);
+        } while (n > 0);
+        _size = _buffer.size();
+        _data = (_size ? &_buffer[0] : NULL);
+    }
+
     void check(int fd, bool cond) const
     {
         if (!cond) {
@@ -189,6 +422,9 @@ private:
 
     void*       _data;
     off_t       _size;
+    int         _fd;
+    bool        _mapped;
+    std::vector<char> _buffer;
     std::string _errorPrefix;
 };
 
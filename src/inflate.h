@@ -0,0 +1,347 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_INFLATE_H
+#define ESOUNPACK_INFLATE_H
+
+#ifndef ZLIB_CONST
+# define ZLIB_CONST
+#endif
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <vector>
+
+
+// zlib counts bytes in uInt, so buffers beyond 4G are handed over in
+// pieces of at most this size.
+inline uInt zlibCount(size_t n)
+{
+    return n > UINT_MAX ? UINT_MAX : uInt(n);
+}
+
+
+// Gives zlib the next piece of input once it has used up the last one;
+// rest is what has not been handed over yet.
+inline void refillInput(z_stream& zs, size_t& rest)
+{
+    if (zs.avail_in == 0 && rest > 0) {
+        zs.avail_in = zlibCount(rest);
+        rest -= zs.avail_in;
+    }
+}
+
+
+// true if inflate stopped only because its current piece of input ran out
+inline bool needsInput(const z_stream& zs, int zerr, size_t rest)
+{
+    return (zerr == Z_OK || zerr == Z_BUF_ERROR) &&
+           zs.avail_out > 0 && zs.avail_in == 0 && rest > 0;
+}
+
+
+inline bool inflateString(const char* in_buf, size_t in_len,
+                          char* out_buf, size_t* out_len)
+{
+    z_stream zs;
+    zs.next_in = (const Bytef*)in_buf;
+    zs.avail_in = 0;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+
+    if (inflateInit(&zs) != Z_OK) {
+        return false;
+    }
+
+    zs.next_out = (Bytef*)out_buf;
+    zs.avail_out = zlibCount(*out_len);
+
+    int zerr;
+    do {
+        refillInput(zs, in_len);
+        zerr = inflate(&zs, Z_FINISH);
+    } while (needsInput(zs, zerr, in_len));
+    *out_len = zs.next_out - (Bytef*)out_buf;
+
+    if (inflateEnd(&zs) != Z_OK) {
+        fprintf(stderr, "zlib: %s\n", zs.msg);
+    }
+
+    return zerr == Z_STREAM_END;
+}
+
+
+// Inflates only the first *out_len bytes of a zlib stream. Succeeds if the
+// output buffer was filled or the stream ended without error.
+inline bool inflatePrefix(const char* in_buf, size_t in_len,
+                          char* out_buf, size_t* out_len)
+{
+    z_stream zs;
+    zs.next_in = (const Bytef*)in_buf;
+    zs.avail_in = 0;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+
+    if (inflateInit(&zs) != Z_OK) {
+        return false;
+    }
+
+    zs.next_out = (Bytef*)out_buf;
+    zs.avail_out = zlibCount(*out_len);
+
+    int zerr;
+    do {
+        refillInput(zs, in_len);
+        zerr = inflate(&zs, Z_SYNC_FLUSH);
+    } while (needsInput(zs, zerr, in_len));
+    *out_len = zs.next_out - (Bytef*)out_buf;
+    inflateEnd(&zs);
+
+    if (zerr == Z_STREAM_END) {
+        return true;
+    }
+    return (zerr == Z_OK || zerr == Z_BUF_ERROR) && zs.avail_out == 0;
+}
+
+
+// Inflates a whole zlib stream through a fixed-size buffer, calling
+// sink(chunk_buf, len) each time it is full and once more for the rest.
+// Every chunk but the last is exactly chunk_len bytes long. Stops early
+// if sink returns false.
+template <typename F>
+bool inflateChunked(const char* in_buf, size_t in_len,
+                    char* chunk_buf, size_t chunk_len, F sink)
+{
+    z_stream zs;
+    zs.next_in = (const Bytef*)in_buf;
+    zs.avail_in = 0;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+
+    if (inflateInit(&zs) != Z_OK) {
+        return false;
+    }
+
+    int zerr = Z_OK;
+    bool more = true;
+
+    while (more && zerr == Z_OK) {
+        zs.next_out = (Bytef*)chunk_buf;
+        zs.avail_out = zlibCount(chunk_len);
+
+        // fill the whole chunk unless the stream ends or breaks
+        while (zs.avail_out > 0 &&
+               (refillInput(zs, in_len), zerr = inflate(&zs, Z_NO_FLUSH)) == Z_OK) {}
+        if (zerr == Z_BUF_ERROR && zs.avail_out == 0) {
+            zerr = Z_OK;
+        }
+
+        size_t len = zs.next_out - (Bytef*)chunk_buf;
+        if ((zerr == Z_OK || zerr == Z_STREAM_END) && len > 0) {
+            more = sink(static_cast<const char*>(chunk_buf), len);
+        }
+    }
+
+    inflateEnd(&zs);
+    return zerr == Z_STREAM_END || (zerr == Z_OK && !more);
+}
+
+
+// Random access into a zlib stream, after zlib's examples/zran.c. A first
+// full pass records a checkpoint about every span bytes of output, at the
+// start of a deflate block: the input position, the bits of the previous
+// byte that belong to the block, and the 32K window before it. A read then
+// resumes raw inflation at the last checkpoint before its offset.
+class InflateIndex
+{
+public:
+
+    static const size_t WINDOW_SIZE = 32768;
+
+    InflateIndex()
+      : _length(0) {}
+
+    bool build(const char* in_buf, size_t in_len, uint64_t span)
+    {
+        z_stream zs;
+        zs.next_in = (const Bytef*)in_buf;
+        zs.avail_in = 0;
+        zs.next_out = Z_NULL;
+        zs.avail_out = 0;
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+
+        if (inflateInit(&zs) != Z_OK) {
+            return false;
+        }
+
+        std::vector<unsigned char> window(WINDOW_SIZE);
+        uint64_t last = 0;
+        int zerr;
+
+        _points.clear();
+        _windows.clear();
+
+        while (true) {
+            if (zs.avail_out == 0) {
+                zs.next_out = window.data();
+                zs.avail_out = WINDOW_SIZE;
+            }
+            refillInput(zs, in_len);
+            zerr = inflate(&zs, Z_BLOCK);
+            if (zerr != Z_OK) {
+                break;
+            }
+            // bit 7: stopped at the end of a block header, bit 6: it is
+            // the last block
+            if ((zs.data_type & 128) && !(zs.data_type & 64) &&
+                (_points.empty() || zs.total_out - last > span)) {
+                addPoint(zs, window);
+                last = zs.total_out;
+            }
+        }
+
+        _length = zs.total_out;
+        inflateEnd(&zs);
+        return zerr == Z_STREAM_END;
+    }
+
+    // uncompressed length of the stream
+    uint64_t length() const
+    {
+        return _length;
+    }
+
+    // memory held by the checkpoints
+    size_t size() const
+    {
+        return _points.size() * sizeof(Point) + _windows.size();
+    }
+
+    // Inflates up to *out_len bytes from offset on into out_buf; at the
+    // end of the stream fewer.
+    bool read(const char* in_buf, size_t in_len, uint64_t offset,
+              char* out_buf, size_t* out_len) const
+    {
+        if (_points.empty()) {
+            return false;
+        }
+
+        auto it = std::upper_bound(_points.begin(), _points.end(), offset,
+                                   [](uint64_t ofs, const Point& p) { return ofs < p.out; });
+        if (it != _points.begin()) {
+            --it;
+        }
+        const Point& p = *it;
+        size_t pi = it - _points.begin();
+
+        if (p.in > in_len) {
+            return false;
+        }
+
+        z_stream zs;
+        zs.next_in = (const Bytef*)in_buf + p.in;
+        zs.avail_in = 0;
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+
+        if (inflateInit2(&zs, -15) != Z_OK) {
+            return false;
+        }
+
+        size_t rest = in_len - p.in;
+        if (p.bits) {
+            inflatePrime(&zs, p.bits, (unsigned char)in_buf[p.in - 1] >> (8 - p.bits));
+        }
+        inflateSetDictionary(&zs, &_windows[pi * WINDOW_SIZE], WINDOW_SIZE);
+
+        // inflate and drop what lies before offset, then fill out_buf
+        std::vector<char> skipBuf;
+        uint64_t skip = offset - std::min(offset, p.out);
+        size_t want = *out_len;
+        int zerr = Z_OK;
+
+        if (skip > 0) {
+            skipBuf.resize(WINDOW_SIZE);
+        }
+        while (skip > 0 && zerr == Z_OK) {
+            zs.next_out = (Bytef*)skipBuf.data();
+            zs.avail_out = std::min(skip, uint64_t(WINDOW_SIZE));
+            refillInput(zs, rest);
+            zerr = inflate(&zs, Z_NO_FLUSH);
+            skip -= (Bytef*)zs.next_out - (Bytef*)skipBuf.data();
+        }
+
+        zs.next_out = (Bytef*)out_buf;
+        zs.avail_out = zlibCount(want);
+        while (skip == 0 && zerr == Z_OK && zs.avail_out > 0) {
+            refillInput(zs, rest);
+            zerr = inflate(&zs, Z_NO_FLUSH);
+        }
+        *out_len = (Bytef*)zs.next_out - (Bytef*)out_buf;
+
+        inflateEnd(&zs);
+        return zerr == Z_OK || zerr == Z_STREAM_END;
+    }
+
+private:
+
+    struct Point
+    {
+        uint64_t    out;    // uncompressed offset
+        uint64_t    in;     // first whole input byte of the block
+        int         bits;   // bits of the byte before that belonging to it
+    };
+
+    void addPoint(const z_stream& zs, const std::vector<unsigned char>& window)
+    {
+        Point p = { zs.total_out, zs.total_in, zs.data_type & 7 };
+        _points.push_back(p);
+
+        // the window is circular, the oldest byte follows the write position
+        size_t used = WINDOW_SIZE - zs.avail_out;
+        _windows.insert(_windows.end(), window.begin() + used, window.end());
+        _windows.insert(_windows.end(), window.begin(), window.begin() + used);
+    }
+
+    uint64_t                    _length;
+    std::vector<Point>          _points;
+    std::vector<unsigned char>  _windows;
+};
+
+
+#endif // ESOUNPACK_INFLATE_H
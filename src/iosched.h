@@ -0,0 +1,169 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_IOSCHED_H
+#define ESOUNPACK_IOSCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "fileio.h"
+
+
+// Orders a batch of reads from the DAT archives by (archive, offset), so
+// that they are served in the order the data lies on disk whatever order
+// they were requested in, and merges reads less than mergeGap apart into
+// spans. Before each read, workers call prefetch(), which asks the kernel
+// to fetch the spans up to window bytes ahead in the background.
+class IoScheduler
+{
+public:
+
+    static const size_t npos = ~size_t(0);
+
+    struct Read
+    {
+        const FileMapping*  dat;
+        unsigned            archive;
+        uint64_t            offset;
+        uint64_t            length;
+        size_t              index;      // the caller's
+        size_t              span;
+    };
+
+    struct Span
+    {
+        const FileMapping*  dat;
+        uint64_t            offset;
+        uint64_t            length;
+    };
+
+    explicit IoScheduler(uint64_t window = 32 << 20, uint64_t mergeGap = 256 << 10)
+      : _window(window)
+      , _mergeGap(mergeGap)
+      , _hinted(0) {}
+
+    void add(const FileMapping& dat, unsigned archive, uint64_t offset, uint64_t length,
+             size_t index)
+    {
+        Read r = { &dat, archive, offset, length, index, 0 };
+        _reads.push_back(r);
+    }
+
+    // sorts the reads and merges them into spans; call after the last add
+    void plan()
+    {
+        std::stable_sort(_reads.begin(), _reads.end(), [](const Read& a, const Read& b) {
+            if (a.archive != b.archive) return a.archive < b.archive;
+            if (a.dat != b.dat) return std::less<const FileMapping*>()(a.dat, b.dat);
+            return a.offset < b.offset;
+        });
+
+        _spans.clear();
+        _positions.clear();
+        _hinted = 0;
+
+        for (size_t k = 0; k < _reads.size(); ++k) {
+            Read& r = _reads[k];
+            Span* last = (_spans.empty() ? NULL : &_spans.back());
+            if (last && last->dat == r.dat && r.offset <= last->offset + last->length + _mergeGap) {
+                last->length = std::max(last->length, r.offset + r.length - last->offset);
+            }
+            else {
+                Span s = { r.dat, r.offset, r.length };
+                _spans.push_back(s);
+            }
+            r.span = _spans.size() - 1;
+
+            if (r.index >= _positions.size()) {
+                _positions.resize(r.index + 1, size_t(npos));
+            }
+            _positions[r.index] = k;
+        }
+    }
+
+    size_t size() const
+    {
+        return _reads.size();
+    }
+
+    // the k-th read in disk order
+    const Read& operator[](size_t k) const
+    {
+        return _reads[k];
+    }
+
+    // where the read added with index ended up, or npos
+    size_t position(size_t index) const
+    {
+        return index < _positions.size() ? _positions[index] : npos;
+    }
+
+    const std::vector<Span>& spans() const
+    {
+        return _spans;
+    }
+
+    // Hints the span of the k-th read and those after it, up to window
+    // bytes on, except for those hinted before. Safe to call from several
+    // workers at once.
+    void prefetch(size_t k)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        size_t si = _reads[k].span;
+        uint64_t ahead = 0;
+
+        for (; si < _spans.size() && ahead < _window; ++si) {
+            const Span& s = _spans[si];
+            uint64_t length = std::min(s.length, _window);
+            if (si >= _hinted) {
+                s.dat->willNeed(s.offset, length);
+                _hinted = si + 1;
+            }
+            ahead += length;
+        }
+    }
+
+private:
+
+    uint64_t            _window;
+    uint64_t            _mergeGap;
+    std::vector<Read>   _reads;
+    std::vector<Span>   _spans;
+    std::vector<size_t> _positions;
+    size_t              _hinted;
+    std::mutex          _mutex;
+};
+
+
+#endif // ESOUNPACK_IOSCHED_H
@@ -0,0 +1,179 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_JOURNAL_H
+#define ESOUNPACK_JOURNAL_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include "fileio.h"
+
+
+// Append-only record of finished work, one "<hex key> <value>" line per
+// item, after a "# <identity>" line naming what the work is done on.
+// Lines are buffered and written by commit() every COMMIT_INTERVAL
+// seconds; it first syncs the file system the work went to and then the
+// journal itself, so that an item is only ever journaled after its output
+// is on disk.
+//
+// A line cut off by a crash is dropped when the journal is loaded again.
+class Journal
+{
+public:
+
+    static const int COMMIT_INTERVAL = 5;
+
+    // Opens the journal at path. With resume, the items it already holds
+    // are loaded, unless they were done on something else than identity,
+    // which is an error; otherwise it is started over.
+    Journal(const std::string& path, bool resume, const std::string& identity)
+      : _path(path)
+      , _lastCommit(std::chrono::steady_clock::now())
+    {
+        std::string data;
+        if (resume) {
+            File fr;
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd != -1) {
+                fr.reset(fd);
+                char buf[1 << 16];
+                ssize_t n;
+                while ((n = fr.read(buf, sizeof(buf))) > 0) {
+                    data.append(buf, n);
+                }
+            }
+        }
+
+        std::string header = "# " + identity + "\n";
+        size_t end = 0;
+        if (data.find('\n') != std::string::npos) {
+            if (data.compare(0, header.size(), header) != 0) {
+                throw std::runtime_error(path + " is the journal of another archive or version,"
+                                         " remove it to start over");
+            }
+            end = header.size();
+        }
+        for (size_t pos = end; pos < data.size(); ) {
+            size_t eol = data.find('\n', pos);
+            if (eol == std::string::npos) {
+                break;
+            }
+            const char* line = data.c_str() + pos;
+            char* sep;
+            uint64_t key = strtoull(line, &sep, 16);
+            if (sep == line || *sep != ' ') {
+                break;
+            }
+            size_t value = sep + 1 - data.c_str();
+            _done[key] = data.substr(value, eol - value);
+            pos = end = eol + 1;
+        }
+
+        _file.open(path, O_WRONLY | O_CREAT, 0644);
+        if (::ftruncate(_file.fd(), end) != 0) {
+            throw std::runtime_error("failed to truncate " + path);
+        }
+        ::lseek(_file.fd(), end, SEEK_SET);
+        if (!end) {
+            _pending = header;
+        }
+    }
+
+    size_t size() const
+    {
+        return _done.size();
+    }
+
+    // the value journaled for key, or NULL
+    const std::string* find(uint64_t key) const
+    {
+        auto it = _done.find(key);
+        return it != _done.end() ? &it->second : NULL;
+    }
+
+    // queues an item for the next commit
+    void add(uint64_t key, const std::string& value)
+    {
+        char tmp[24];
+        snprintf(tmp, sizeof(tmp), "%llx ", (unsigned long long)key);
+        _pending.append(tmp);
+        _pending.append(value);
+        _pending.append(1, '\n');
+    }
+
+    // makes the output under syncDir and then the queued items durable,
+    // if COMMIT_INTERVAL has passed since the last time
+    void commit(const std::string& syncDir)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (_pending.empty() || now - _lastCommit < std::chrono::seconds(int(COMMIT_INTERVAL))) {
+            return;
+        }
+        _lastCommit = now;
+        int fd = ::open(syncDir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd != -1) {
+            ::syncfs(fd);
+            ::close(fd);
+        }
+        for (size_t pos = 0; pos < _pending.size(); ) {
+            pos += _file.write(_pending.data() + pos, _pending.size() - pos);
+        }
+        if (::fdatasync(_file.fd()) != 0) {
+            throw std::runtime_error("failed to sync " + _path);
+        }
+        _pending.clear();
+    }
+
+    // deletes the journal once all the work is done
+    void remove()
+    {
+        _file.close();
+        _pending.clear();
+        ::unlink(_path.c_str());
+    }
+
+private:
+
+    std::string                         _path;
+    std::chrono::steady_clock::time_point _lastCommit;
+    File                                _file;
+    std::map<uint64_t, std::string>     _done;
+    std::string                         _pending;
+};
+
+
+#endif // ESOUNPACK_JOURNAL_H
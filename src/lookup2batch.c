@@ -0,0 +1,244 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+/*
+--------------------------------------------------------------------
+hash_batch() -- hash many keys with lookup2's hash() at once.
+
+Keys are processed in groups of HASH_LANES, one key per vector lane,
+using GCC vector extensions. The results are bit-identical to calling
+hash(keys[i], lengths[i], initval) for each key.
+
+If lengths is NULL, the keys are taken to be NUL-terminated strings.
+Compile with -DSELF_TEST to check the lanes against the scalar hash().
+--------------------------------------------------------------------
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef SELF_TEST
+#include <stdio.h>
+#include <stdlib.h>
+#endif
+
+typedef uint32_t ub4;
+typedef uint8_t  ub1;
+
+#define HASH_LANES 8
+
+typedef ub4 vub4 __attribute__((vector_size(sizeof(ub4) * HASH_LANES)));
+
+uint32_t hash(const char* k, uint32_t length, uint32_t initval);
+
+/* same as mix() in lookup2.c, applied to all lanes */
+#define mix(a,b,c) \
+{ \
+  a -= b; a -= c; a ^= (c>>13); \
+  b -= c; b -= a; b ^= (a<<8); \
+  c -= a; c -= b; c ^= (b>>13); \
+  a -= b; a -= c; a ^= (c>>12);  \
+  b -= c; b -= a; b ^= (a<<16); \
+  c -= a; c -= b; c ^= (b>>5); \
+  a -= b; a -= c; a ^= (c>>3);  \
+  b -= c; b -= a; b ^= (a<<10); \
+  c -= a; c -= b; c ^= (b>>15); \
+}
+
+static const ub1 zeros[12];
+
+static inline ub4 load_le32(const ub1* k)
+{
+    return k[0] | ((ub4)k[1] << 8) | ((ub4)k[2] << 16) | ((ub4)k[3] << 24);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void hash_lanes(const ub1* const* keys, const ub4* lengths,
+                       ub4 initval, ub4* results)
+{
+    vub4 a, b, c, ka, kb, kc, active;
+    ub4 blocks[HASH_LANES];
+    ub4 maxblocks = 0;
+    int lane;
+    ub4 i;
+
+    for (lane = 0; lane < HASH_LANES; ++lane) {
+        blocks[lane] = lengths[lane] / 12;
+        if (maxblocks < blocks[lane]) {
+            maxblocks = blocks[lane];
+        }
+        a[lane] = b[lane] = 0x9e3779b9;
+        c[lane] = initval;
+    }
+
+    /*---------------------------------------- handle most of the keys */
+    for (i = 0; i < maxblocks; ++i) {
+        ub4 wa[HASH_LANES], wb[HASH_LANES], wc[HASH_LANES], wm[HASH_LANES];
+        vub4 na, nb, nc;
+        for (lane = 0; lane < HASH_LANES; ++lane) {
+            /* exhausted lanes read zeros and are masked out below */
+            const ub1* k = (i < blocks[lane] ? keys[lane] + 12 * i : zeros);
+            wa[lane] = load_le32(k);
+            wb[lane] = load_le32(k + 4);
+            wc[lane] = load_le32(k + 8);
+            wm[lane] = -(ub4)(i < blocks[lane]);
+        }
+        memcpy(&ka, wa, sizeof(ka));
+        memcpy(&kb, wb, sizeof(kb));
+        memcpy(&kc, wc, sizeof(kc));
+        memcpy(&active, wm, sizeof(active));
+        na = a + ka;
+        nb = b + kb;
+        nc = c + kc;
+        mix(na, nb, nc);
+        /* lanes whose key is exhausted keep their state */
+        a = (na & active) | (a & ~active);
+        b = (nb & active) | (b & ~active);
+        c = (nc & active) | (c & ~active);
+    }
+
+    /*------------------------------------- handle the last 11 bytes */
+    for (lane = 0; lane < HASH_LANES; ++lane) {
+        ub4 len = lengths[lane] - 12 * blocks[lane];
+        uint64_t lo = 0, hi = 0;
+        if (lengths[lane] >= 12) {
+            /* load the key's last 12 bytes and shift out the ones
+               already consumed, rather than copying byte by byte */
+            const ub1* k = keys[lane] + lengths[lane] - 12;
+            ub4 s = 8 * (12 - len);
+            lo = load_le32(k) | ((uint64_t)load_le32(k + 4) << 32);
+            hi = load_le32(k + 8);
+            if (s >= 64) {
+                lo = (s < 96 ? hi >> (s - 64) : 0);
+                hi = 0;
+            }
+            else {
+                lo = (lo >> s) | (hi << (64 - s));
+                hi >>= s;
+            }
+        }
+        else {
+            const ub1* k = keys[lane];
+            ub4 j;
+            for (j = 0; j < len; ++j) {
+                if (j < 8) {
+                    lo |= (uint64_t)k[j] << (8 * j);
+                }
+                else {
+                    hi |= (uint64_t)k[j] << (8 * (j - 8));
+                }
+            }
+        }
+        ka[lane] = (ub4)lo;
+        kb[lane] = (ub4)(lo >> 32);
+        /* the first byte of c is reserved for the length */
+        kc[lane] = ((ub4)hi << 8) + lengths[lane];
+    }
+    a += ka;
+    b += kb;
+    c += kc;
+    mix(a, b, c);
+
+    for (lane = 0; lane < HASH_LANES; ++lane) {
+        results[lane] = c[lane];
+    }
+}
+
+void hash_batch(const char* const* keys, const uint32_t* lengths,
+                size_t count, uint32_t initval, uint32_t* results)
+{
+    const ub1* k[HASH_LANES];
+    ub4 len[HASH_LANES];
+    ub4 res[HASH_LANES];
+    size_t i = 0;
+    int lane;
+
+    while (i < count) {
+        int n = (count - i < HASH_LANES ? (int)(count - i) : HASH_LANES);
+        for (lane = 0; lane < HASH_LANES; ++lane) {
+            if (lane < n) {
+                k[lane] = (const ub1*)keys[i + lane];
+                len[lane] = (lengths ? lengths[i + lane] : strlen(keys[i + lane]));
+            }
+            else {
+                k[lane] = (const ub1*)"";
+                len[lane] = 0;
+            }
+        }
+        hash_lanes(k, len, initval, res);
+        for (lane = 0; lane < n; ++lane) {
+            results[i + lane] = res[lane];
+        }
+        i += n;
+    }
+}
+
+#ifdef SELF_TEST
+
+/* compare hash_batch() against hash() for random keys of all lengths */
+int main()
+{
+    enum { COUNT = 10000, MAXLEN = 100 };
+    static char buf[COUNT][MAXLEN + 1];
+    static const char* keys[COUNT];
+    static ub4 lengths[COUNT];
+    static ub4 results[COUNT];
+    int i, j, failures = 0;
+
+    for (i = 0; i < COUNT; ++i) {
+        lengths[i] = (i < MAXLEN ? i : rand() % (MAXLEN + 1));
+        for (j = 0; j < (int)lengths[i]; ++j) {
+            buf[i][j] = (char)(1 + rand() % 255);
+        }
+        buf[i][lengths[i]] = '\0';
+        keys[i] = buf[i];
+    }
+
+    hash_batch(keys, lengths, COUNT, 0xa8396, results);
+    for (i = 0; i < COUNT; ++i) {
+        if (results[i] != hash(keys[i], lengths[i], 0xa8396)) {
+            printf("mismatch for key %d length %u\n", i, lengths[i]);
+            ++failures;
+        }
+    }
+
+    hash_batch(keys, NULL, COUNT, 0, results);
+    for (i = 0; i < COUNT; ++i) {
+        if (results[i] != hash(keys[i], lengths[i], 0)) {
+            printf("mismatch for NUL-terminated key %d\n", i);
+            ++failures;
+        }
+    }
+
+    printf("%d keys, %d mismatches\n", COUNT, failures);
+    return failures != 0;
+}
+
+#endif
@@ -0,0 +1,137 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_LRUCACHE_H
+#define ESOUNPACK_LRUCACHE_H
+
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+
+// Least-recently-used cache of immutable values, byte strings unless
+// given otherwise, bounded by the sum of their size(). Values are shared,
+// so one that is evicted while a reader still holds it lives on until
+// that reader is done with it.
+template <typename Key, typename T = std::string>
+class LruCache
+{
+public:
+
+    typedef std::shared_ptr<const T> Value;
+
+    explicit LruCache(uint64_t limit)
+      : _limit(limit)
+      , _size(0)
+      , _hits(0)
+      , _misses(0) {}
+
+    // the cached value, or an empty pointer
+    Value get(const Key& key)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(key);
+        if (it == _index.end()) {
+            _misses++;
+            return Value();
+        }
+        _order.splice(_order.begin(), _order, it->second);
+        _hits++;
+        return it->second->second;
+    }
+
+    // adds or replaces a value, evicting the least recently used ones
+    // to make room; a value larger than the whole cache is not kept
+    void put(const Key& key, Value value)
+    {
+        if (!value || value->size() > _limit) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(key);
+        if (it != _index.end()) {
+            _size -= it->second->second->size();
+            _order.erase(it->second);
+            _index.erase(it);
+        }
+        _order.push_front(std::make_pair(key, value));
+        _index[key] = _order.begin();
+        _size += value->size();
+
+        while (_size > _limit) {
+            const Entry& last = _order.back();
+            _size -= last.second->size();
+            _index.erase(last.first);
+            _order.pop_back();
+        }
+    }
+
+    uint64_t limit() const
+    {
+        return _limit;
+    }
+
+    uint64_t size() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _size;
+    }
+
+    uint64_t hits() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _hits;
+    }
+
+    uint64_t misses() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _misses;
+    }
+
+private:
+
+    typedef std::pair<Key, Value> Entry;
+    typedef std::list<Entry> EntryList;
+
+    uint64_t                                                _limit;
+    uint64_t                                                _size;
+    uint64_t                                                _hits;
+    uint64_t                                                _misses;
+    EntryList                                               _order;
+    std::unordered_map<Key, typename EntryList::iterator>   _index;
+    mutable std::mutex                                      _mutex;
+};
+
+
+#endif // ESOUNPACK_LRUCACHE_H
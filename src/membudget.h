@@ -0,0 +1,197 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_MEMBUDGET_H
+#define ESOUNPACK_MEMBUDGET_H
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+
+// Byte-counting semaphore shared by all buffers that may grow with the
+// size of a subfile. A limit of 0 means unlimited.
+//
+// Threads must not wait for a lease while holding another one; a request
+// larger than the whole budget is clamped to it, so it only waits until
+// everybody else is done.
+class MemoryBudget
+{
+public:
+
+    explicit MemoryBudget(uint64_t limit = 0)
+      : _limit(limit)
+      , _used(0)
+      , _peak(0) {}
+
+    uint64_t limit() const
+    {
+        return _limit;
+    }
+
+    void setLimit(uint64_t limit)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _limit = limit;
+        _released.notify_all();
+    }
+
+    // highest amount ever accounted at once
+    uint64_t peak() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _peak;
+    }
+
+    // blocks until n bytes are available and returns the amount taken
+    uint64_t acquire(uint64_t n)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_limit) {
+            n = std::min(n, _limit);
+            _released.wait(lock, [this, n] { return _used + n <= _limit; });
+        }
+        take(n);
+        return n;
+    }
+
+    // takes n bytes only if that needs no waiting
+    bool tryAcquire(uint64_t n)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_limit && _used + n > _limit) {
+            return false;
+        }
+        take(n);
+        return true;
+    }
+
+    // accounts n bytes without waiting, for buffers that cannot be split
+    void overdraw(uint64_t n)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        take(n);
+    }
+
+    void release(uint64_t n)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _used -= n;
+        _released.notify_all();
+    }
+
+    // Holds part of the budget for the lifetime of a buffer.
+    class Lease
+    {
+    public:
+
+        Lease(MemoryBudget& budget, uint64_t n)
+          : _budget(budget)
+          , _size(budget.acquire(n)) {}
+
+        ~Lease()
+        {
+            _budget.release(_size);
+        }
+
+        uint64_t size() const
+        {
+            return _size;
+        }
+
+        // gives back what is held beyond n bytes
+        void shrink(uint64_t n)
+        {
+            if (n < _size) {
+                _budget.release(_size - n);
+                _size = n;
+            }
+        }
+
+        // grows the lease to cover n bytes if that needs no waiting
+        bool tryCover(uint64_t n)
+        {
+            if (n > _size) {
+                if (!_budget.tryAcquire(n - _size)) {
+                    return false;
+                }
+                _size = n;
+            }
+            return true;
+        }
+
+        // grows the lease to cover n bytes, without waiting, even past
+        // the limit; only for buffers that must be kept whole
+        void cover(uint64_t n)
+        {
+            if (n > _size) {
+                _budget.overdraw(n - _size);
+                _size = n;
+            }
+        }
+
+    private:
+
+        Lease(const Lease&);
+        Lease& operator=(const Lease&);
+
+        MemoryBudget&   _budget;
+        uint64_t        _size;
+    };
+
+private:
+
+    void take(uint64_t n)
+    {
+        _used += n;
+        _peak = std::max(_peak, _used);
+    }
+
+    uint64_t                    _limit;
+    uint64_t                    _used;
+    uint64_t                    _peak;
+    mutable std::mutex          _mutex;
+    std::condition_variable     _released;
+};
+
+
+// peak resident set size of this process in bytes
+inline uint64_t peakRSS()
+{
+    struct rusage ru;
+    if (::getrusage(RUSAGE_SELF, &ru) != 0) {
+        return 0;
+    }
+    return uint64_t(ru.ru_maxrss) * 1024;
+}
+
+
+#endif // ESOUNPACK_MEMBUDGET_H
@@ -0,0 +1,271 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_PATHINDEX_H
+#define ESOUNPACK_PATHINDEX_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+
+// Minimal perfect hash over a set of path names, in the style of CHD /
+// PTHash: keys are distributed into buckets of about five, and for each
+// bucket a pilot value is searched that sends all its keys to free slots.
+// The few keys landing past the end of the minimal table are redirected
+// through a small remap array.
+//
+// The index does not copy the names; the caller keeps them alive. Keys are
+// identified by their lookup2 hash, so resolving a path costs one hash,
+// one pilot probe and one string compare. Names sharing a 32-bit hash
+// cannot be separated by any pilot and are kept in a small overflow list.
+class PathIndex
+{
+public:
+
+    static const uint32_t npos = ~uint32_t(0);
+
+    PathIndex()
+      : _bucketCount(0)
+      , _tableSize(0) {}
+
+    // names[i], lengths[i] and hashes[i] describe key i; find() returns i
+    void build(const char* const* names, const uint32_t* lengths,
+               const uint32_t* hashes, size_t count)
+    {
+        _names.assign(names, names + count);
+        _lengths.assign(lengths, lengths + count);
+        _slots.clear();
+        _pilots.clear();
+        _overflow.clear();
+
+        std::vector<uint32_t> order(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(),
+                         [hashes](uint32_t x, uint32_t y) { return hashes[x] < hashes[y]; });
+
+        // duplicate names keep their first occurrence; distinct names with
+        // equal hashes go to the overflow list
+        std::vector<uint32_t> keys;
+        std::vector<uint32_t> group;
+        keys.reserve(count);
+        for (size_t i = 0; i < count; ) {
+            size_t j = i;
+            group.clear();
+            for (; j < count && hashes[order[j]] == hashes[order[i]]; ++j) {
+                uint32_t k = order[j];
+                bool dup = false;
+                for (uint32_t g : group) {
+                    dup = dup || matches(g, _names[k], _lengths[k]);
+                }
+                if (!dup) {
+                    group.push_back(k);
+                }
+            }
+            if (group.size() == 1) {
+                keys.push_back(group[0]);
+            }
+            else {
+                _overflow.insert(_overflow.end(), group.begin(), group.end());
+            }
+            i = j;
+        }
+
+        size_t n = keys.size();
+        _bucketCount = (n + 4) / 5;
+        _tableSize = n + n / 9 + 1;
+        _pilots.assign(_bucketCount, 0);
+        _slots.assign(n, uint32_t(npos));
+        _hashes.assign(n, 0);
+        _remap.clear();
+        if (n == 0) {
+            return;
+        }
+
+        // bucket keys, then place the largest buckets first
+        std::vector<uint32_t> bucketStart(_bucketCount + 1, 0);
+        for (uint32_t k : keys) {
+            bucketStart[bucketOf(hashes[k]) + 1]++;
+        }
+        for (size_t b = 0; b < _bucketCount; ++b) {
+            bucketStart[b + 1] += bucketStart[b];
+        }
+        std::vector<uint32_t> bucketKeys(n);
+        std::vector<uint32_t> fill(bucketStart.begin(), bucketStart.end() - 1);
+        for (uint32_t k : keys) {
+            bucketKeys[fill[bucketOf(hashes[k])]++] = k;
+        }
+
+        std::vector<uint32_t> bucketOrder(_bucketCount);
+        for (uint32_t b = 0; b < _bucketCount; ++b) {
+            bucketOrder[b] = b;
+        }
+        std::stable_sort(bucketOrder.begin(), bucketOrder.end(),
+                         [&bucketStart](uint32_t x, uint32_t y) {
+                             return bucketStart[x + 1] - bucketStart[x] >
+                                    bucketStart[y + 1] - bucketStart[y];
+                         });
+
+        // keys are first placed in a table with 10% spare slots, which
+        // keeps the pilot search short for the last buckets
+        std::vector<uint32_t> table(_tableSize, uint32_t(npos));
+        std::vector<uint32_t> positions;
+        for (uint32_t b : bucketOrder) {
+            uint32_t first = bucketStart[b];
+            uint32_t last = bucketStart[b + 1];
+            if (first == last) {
+                break;
+            }
+            for (uint32_t pilot = 0; ; ++pilot) {
+                if (pilot == npos) {
+                    throw std::runtime_error("path index: no pilot found");
+                }
+                positions.clear();
+                for (uint32_t i = first; i < last; ++i) {
+                    uint32_t pos = slotOf(hashes[bucketKeys[i]], pilot);
+                    if (table[pos] != npos ||
+                        std::find(positions.begin(), positions.end(), pos) != positions.end()) {
+                        break;
+                    }
+                    positions.push_back(pos);
+                }
+                if (positions.size() == last - first) {
+                    for (uint32_t i = first; i < last; ++i) {
+                        table[positions[i - first]] = bucketKeys[i];
+                    }
+                    _pilots[b] = pilot;
+                    break;
+                }
+            }
+        }
+
+        // make it minimal: positions past n are remapped to the free
+        // slots below n, of which there are exactly as many
+        _remap.assign(_tableSize - n, uint32_t(npos));
+        size_t freePos = 0;
+        for (size_t pos = 0; pos < _tableSize; ++pos) {
+            uint32_t k = table[pos];
+            if (k == npos) {
+                continue;
+            }
+            size_t dst = pos;
+            if (pos >= n) {
+                while (table[freePos] != npos) {
+                    ++freePos;
+                }
+                dst = freePos++;
+                _remap[pos - n] = dst;
+            }
+            _slots[dst] = k;
+            _hashes[dst] = hashes[k];
+        }
+    }
+
+    // h must be the same hash of path that was passed to build()
+    uint32_t find(const char* path, size_t len, uint32_t h) const
+    {
+        if (!_slots.empty()) {
+            uint32_t pos = slotOf(h, _pilots[bucketOf(h)]);
+            if (pos >= _slots.size()) {
+                pos = _remap[pos - _slots.size()];
+            }
+            if (pos != npos && _hashes[pos] == h && matches(_slots[pos], path, len)) {
+                return _slots[pos];
+            }
+        }
+        for (uint32_t k : _overflow) {
+            if (matches(k, path, len)) {
+                return k;
+            }
+        }
+        return npos;
+    }
+
+    size_t size() const
+    {
+        return _names.size();
+    }
+
+private:
+
+    static uint64_t mix64(uint64_t x)
+    {
+        // splitmix64 finalizer
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+
+    uint32_t bucketOf(uint32_t h) const
+    {
+        // skewed as in PTHash: 60% of the keys go to 30% of the buckets,
+        // so the big buckets are placed while the table is still empty
+        uint64_t x = mix64(h + 0x9e3779b97f4a7c15ull);
+        uint64_t r = x >> 32;
+        uint64_t dense = _bucketCount * 3 / 10;
+        if (dense == 0) {
+            return (r * _bucketCount) >> 32;
+        }
+        if ((uint32_t)x < 0x9999999au) {
+            return (r * dense) >> 32;
+        }
+        return dense + ((r * (_bucketCount - dense)) >> 32);
+    }
+
+    uint32_t slotOf(uint32_t h, uint32_t pilot) const
+    {
+        uint64_t x = mix64(((uint64_t)pilot << 32) | h);
+        return ((x >> 32) * _tableSize) >> 32;
+    }
+
+    bool matches(uint32_t k, const char* path, size_t len) const
+    {
+        return _lengths[k] == len && !memcmp(_names[k], path, len);
+    }
+
+    size_t                      _bucketCount;
+    size_t                      _tableSize;
+    std::vector<const char*>    _names;
+    std::vector<uint32_t>       _lengths;
+    std::vector<uint32_t>       _pilots;
+    std::vector<uint32_t>       _slots;
+    std::vector<uint32_t>       _hashes;
+    std::vector<uint32_t>       _remap;
+    std::vector<uint32_t>       _overflow;
+};
+
+
+#endif // ESOUNPACK_PATHINDEX_H
@@ -0,0 +1,245 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_RECORDFORMAT_H
+#define ESOUNPACK_RECORDFORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+
+// Record descriptors: a layout is declared once as a list of fields with
+// their offset and byte order, and the decoders below are generated from
+// it at compile time. Every field access is a fixed-offset memcpy plus a
+// byte swap if the order differs from the host's, so on little-endian
+// hosts decoding little-endian records compiles down to plain loads.
+//
+//   typedef RecordFormat<8,
+//       Field<uint32_t, 0, ByteOrder::Little>,
+//       Field<uint32_t, 4, ByteOrder::Little>> PairFormat;
+//
+//   PairFormat::decodeColumns(buf, len, count, firsts, seconds);
+
+
+enum class ByteOrder { Little, Big };
+
+static const ByteOrder HOST_BYTE_ORDER =
+    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? ByteOrder::Little : ByteOrder::Big);
+
+
+template <size_t N> struct ByteSwap;
+
+template <> struct ByteSwap<1>
+{
+    static uint8_t apply(uint8_t v) { return v; }
+};
+
+template <> struct ByteSwap<2>
+{
+    static uint16_t apply(uint16_t v) { return __builtin_bswap16(v); }
+};
+
+template <> struct ByteSwap<4>
+{
+    static uint32_t apply(uint32_t v) { return __builtin_bswap32(v); }
+};
+
+template <> struct ByteSwap<8>
+{
+    static uint64_t apply(uint64_t v) { return __builtin_bswap64(v); }
+};
+
+
+// A T at byte Offset of a record, stored in byte order O.
+template <typename T, size_t Offset, ByteOrder O>
+struct Field
+{
+    typedef T type;
+
+    static const size_t end = Offset + sizeof(T);
+    static const bool swapped = (O != HOST_BYTE_ORDER && sizeof(T) > 1);
+
+    static T load(const char* rec)
+    {
+        T v;
+        memcpy(&v, rec + Offset, sizeof(T));
+        return swapped ? swap(v) : v;
+    }
+
+    // converts the field in place to host byte order
+    static void toHost(char* rec)
+    {
+        if (swapped) {
+            T v = load(rec);
+            memcpy(rec + Offset, &v, sizeof(T));
+        }
+    }
+
+private:
+
+    static T swap(T v)
+    {
+        typedef decltype(ByteSwap<sizeof(T)>::apply(0)) U;
+        U u;
+        memcpy(&u, &v, sizeof(T));
+        u = ByteSwap<sizeof(T)>::apply(u);
+        memcpy(&v, &u, sizeof(T));
+        return v;
+    }
+};
+
+
+// Field F, decoded into member M of S.
+template <typename S, typename T, T S::*M, typename F>
+struct Member : F
+{
+    static void decode(const char* rec, S& s)
+    {
+        s.*M = F::load(rec);
+    }
+};
+
+
+// N consecutive Ts from byte Offset, decoded into the array member M of S.
+template <typename S, typename T, size_t N, T (S::*M)[N], size_t Offset, ByteOrder O>
+struct ArrayMember
+{
+    typedef Field<T, Offset, O> Element;
+
+    static const size_t end = Offset + N * sizeof(T);
+    static const bool swapped = Element::swapped;
+
+    static void decode(const char* rec, S& s)
+    {
+        for (size_t i = 0; i < N; ++i) {
+            (s.*M)[i] = Element::load(rec + i * sizeof(T));
+        }
+    }
+
+    static void toHost(char* rec)
+    {
+        for (size_t i = 0; i < N; ++i) {
+            Element::toHost(rec + i * sizeof(T));
+        }
+    }
+};
+
+
+template <typename... Fields> struct FieldsEnd;
+
+template <> struct FieldsEnd<>
+{
+    static const size_t value = 0;
+};
+
+template <typename F, typename... Rest> struct FieldsEnd<F, Rest...>
+{
+    static const size_t value = (F::end > FieldsEnd<Rest...>::value ?
+                                 F::end : FieldsEnd<Rest...>::value);
+};
+
+
+template <typename... Fields> struct FieldsSwapped;
+
+template <> struct FieldsSwapped<>
+{
+    static const bool value = false;
+};
+
+template <typename F, typename... Rest> struct FieldsSwapped<F, Rest...>
+{
+    static const bool value = F::swapped || FieldsSwapped<Rest...>::value;
+};
+
+
+// A record of Size bytes made of Fields. Decoders check the buffer length
+// once per call, never per field.
+template <size_t Size, typename... Fields>
+struct RecordFormat
+{
+    static_assert(FieldsEnd<Fields...>::value <= Size, "field extends past the record");
+
+    static const size_t size = Size;
+
+    // decodes one record into s; Fields must be Members of S
+    template <typename S>
+    static bool decode(const char* buf, size_t len, S& s)
+    {
+        if (len < Size) {
+            return false;
+        }
+        int expand[] = { 0, (Fields::decode(buf, s), 0)... };
+        (void)expand;
+        return true;
+    }
+
+    // decodes up to count consecutive records into out, as many as len
+    // holds, and returns that number
+    template <typename S>
+    static size_t decodeArray(const char* buf, size_t len, S* out, size_t count)
+    {
+        count = std::min(count, len / Size);
+        for (size_t i = 0; i < count; ++i, buf += Size) {
+            int expand[] = { 0, (Fields::decode(buf, out[i]), 0)... };
+            (void)expand;
+        }
+        return count;
+    }
+
+    // decodes up to count consecutive records into one array per field
+    template <typename... Columns>
+    static size_t decodeColumns(const char* buf, size_t len, size_t count, Columns*... cols)
+    {
+        static_assert(sizeof...(Columns) == sizeof...(Fields), "need one column per field");
+        count = std::min(count, len / Size);
+        for (size_t i = 0; i < count; ++i, buf += Size) {
+            int expand[] = { 0, (cols[i] = Fields::load(buf), 0)... };
+            (void)expand;
+        }
+        return count;
+    }
+
+    // converts count consecutive records in place to host byte order, so
+    // they can be used as packed structs; a no-op if no field needs it
+    static void toHost(char* buf, size_t count)
+    {
+        if (!FieldsSwapped<Fields...>::value) {
+            return;
+        }
+        for (size_t i = 0; i < count; ++i, buf += Size) {
+            int expand[] = { 0, (Fields::toHost(buf), 0)... };
+            (void)expand;
+        }
+    }
+};
+
+
+#endif // ESOUNPACK_RECORDFORMAT_H
@@ -0,0 +1,347 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_SERVER_H
+#define ESOUNPACK_SERVER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "membudget.h"
+#include "threadpool.h"
+
+
+// Line-oriented request server on a Unix domain socket. The thread in
+// run() polls the listening socket and every idle connection; one that
+// has data is handed to the worker pool, which answers each complete
+// request line in it and hands the connection back. A connection is thus
+// served by one worker at a time and gets its responses in order.
+// Responses are sent without blocking: what the client does not take is
+// kept with the connection, which then waits to be writable and is not
+// served further requests until all of it has been sent.
+class SocketServer
+{
+public:
+
+    static const size_t MAX_REQUEST = 0x10000;
+
+    explicit SocketServer(const std::string& path)
+      : _path(path)
+      , _listenFd(-1)
+      , _requests(0)
+    {
+        _wake[0] = _wake[1] = -1;
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("socket path too long: " + path);
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        // a socket left behind by an earlier run would make bind fail
+        struct stat st;
+        if (::lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            ::unlink(path.c_str());
+        }
+
+        _listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (_listenFd == -1 ||
+            ::bind(_listenFd, (const struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            ::listen(_listenFd, 64) != 0 ||
+            ::pipe2(_wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+            std::string err = ::strerror(errno);
+            closeAll();
+            throw std::runtime_error(path + ": " + err);
+        }
+    }
+
+    ~SocketServer()
+    {
+        closeAll();
+        ::unlink(_path.c_str());
+    }
+
+    size_t requests() const
+    {
+        return _requests;
+    }
+
+    // Serves until SIGINT or SIGTERM. handle(request, response, lease) is
+    // called on the pool for every request line, without its line break,
+    // and fills in the bytes to send back. It may set lease to one that
+    // charges the response to a budget; that is held until it is sent.
+    template <typename F>
+    void run(WorkerPool& pool, F handle)
+    {
+        std::vector<Connection*> idle;
+        std::vector<struct pollfd> fds;
+        F* phandle = &handle;
+        bool stopping = false;
+
+        stopFd() = _wake[1];
+        struct sigaction sa, oldInt, oldTerm;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &SocketServer::onSignal;
+        ::sigaction(SIGINT, &sa, &oldInt);
+        ::sigaction(SIGTERM, &sa, &oldTerm);
+
+        while (!stopping) {
+            fds.clear();
+            struct pollfd pl = { _listenFd, POLLIN, 0 };
+            struct pollfd pw = { _wake[0], POLLIN, 0 };
+            fds.push_back(pl);
+            fds.push_back(pw);
+            for (Connection* c : idle) {
+                struct pollfd pc = { c->fd, short(c->out.empty() ? POLLIN : POLLOUT), 0 };
+                fds.push_back(pc);
+            }
+
+            if (::poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("poll: ") + ::strerror(errno));
+            }
+
+            // busy connections are handed in through the wake pipe, and
+            // so is the stop request
+            if (fds[1].revents) {
+                char buf[64];
+                ssize_t n;
+                while ((n = ::read(_wake[0], buf, sizeof(buf))) > 0) {
+                    stopping = stopping || memchr(buf, 'q', n);
+                }
+            }
+
+            std::vector<Connection*> stillIdle;
+            for (size_t i = 0; i < idle.size(); ++i) {
+                Connection* c = idle[i];
+                if (!fds[i + 2].revents) {
+                    stillIdle.push_back(c);
+                    continue;
+                }
+                pool.submit([this, c, phandle]() {
+                    serve(c, *phandle);
+                });
+            }
+            idle.swap(stillIdle);
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                idle.insert(idle.end(), _returned.begin(), _returned.end());
+                _returned.clear();
+            }
+
+            if (fds[0].revents & POLLIN) {
+                int fd = ::accept4(_listenFd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd != -1) {
+                    idle.push_back(new Connection(fd));
+                }
+            }
+        }
+
+        ::sigaction(SIGINT, &oldInt, NULL);
+        ::sigaction(SIGTERM, &oldTerm, NULL);
+        stopFd() = -1;
+
+        pool.wait();
+        idle.insert(idle.end(), _returned.begin(), _returned.end());
+        _returned.clear();
+        for (Connection* c : idle) {
+            delete c;
+        }
+    }
+
+private:
+
+    struct Connection
+    {
+        explicit Connection(int fd)
+          : fd(fd)
+          , sent(0) {}
+
+        ~Connection()
+        {
+            ::close(fd);
+        }
+
+        int         fd;
+        std::string in;
+        std::string out;    // response being sent
+        size_t      sent;   // how much of it is
+        std::unique_ptr<MemoryBudget::Lease> lease;     // what out is charged to
+    };
+
+    static int& stopFd()
+    {
+        static int fd = -1;
+        return fd;
+    }
+
+    static void onSignal(int)
+    {
+        int saved = errno;
+        if (stopFd() != -1) {
+            ssize_t n = ::write(stopFd(), "q", 1);
+            (void)n;
+        }
+        errno = saved;
+    }
+
+    // sends what is left of the last response, then reads what the client
+    // has sent and answers every complete line, until a response does not
+    // go out completely
+    template <typename F>
+    void serve(Connection* c, F& handle)
+    {
+        if (!flush(c)) {
+            delete c;
+            return;
+        }
+        if (!c->out.empty()) {
+            giveBack(c);
+            return;
+        }
+
+        char buf[0x1000];
+        ssize_t n = ::recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            delete c;
+            return;
+        }
+        if (n > 0) {
+            c->in.append(buf, n);
+        }
+
+        size_t eol;
+        std::string request, response;
+        std::unique_ptr<MemoryBudget::Lease> lease;
+        while (c->out.empty() && (eol = c->in.find('\n')) != std::string::npos) {
+            request.assign(c->in, 0, eol);
+            c->in.erase(0, eol + 1);
+            if (!request.empty() && request[request.size() - 1] == '\r') {
+                request.erase(request.size() - 1);
+            }
+            response.clear();
+            lease.reset();
+            try {
+                handle(request, response, lease);
+            }
+            catch (std::exception& e) {
+                response = std::string("ERR ") + e.what() + "\n";
+                lease.reset();
+            }
+            _requests++;
+            c->out.swap(response);
+            c->lease.swap(lease);
+            if (!flush(c)) {
+                delete c;
+                return;
+            }
+        }
+
+        if (c->out.empty() && c->in.size() > MAX_REQUEST) {
+            c->out = "ERR request too long\n";
+            flush(c);
+            delete c;
+            return;
+        }
+
+        giveBack(c);
+    }
+
+    // hands a connection back to run() to be polled
+    void giveBack(Connection* c)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _returned.push_back(c);
+        ssize_t w = ::write(_wake[1], "c", 1);
+        (void)w;
+    }
+
+    // sends as much of c->out as the socket takes without blocking;
+    // false if the connection is broken
+    static bool flush(Connection* c)
+    {
+        while (c->sent < c->out.size()) {
+            ssize_t n = ::send(c->fd, c->out.data() + c->sent, c->out.size() - c->sent,
+                               MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            c->sent += n;
+        }
+        // freed, not just cleared, as the lease goes with it
+        std::string().swap(c->out);
+        c->lease.reset();
+        c->sent = 0;
+        return true;
+    }
+
+    void closeAll()
+    {
+        for (int* fd : { &_listenFd, &_wake[0], &_wake[1] }) {
+            if (*fd != -1) {
+                ::close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+
+    std::string                 _path;
+    int                         _listenFd;
+    int                         _wake[2];
+    std::atomic<size_t>         _requests;
+    std::mutex                  _mutex;
+    std::vector<Connection*>    _returned;
+};
+
+
+#endif // ESOUNPACK_SERVER_H
@@ -0,0 +1,460 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_STORE_H
+#define ESOUNPACK_STORE_H
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fileio.h"
+
+
+// MurmurHash64A by Austin Appleby (public domain), little-endian words.
+// The total length is mixed in first, so it must be known up front; the
+// data itself may then be fed in pieces of any size.
+class Murmur64
+{
+public:
+
+    Murmur64(uint64_t len, uint64_t seed = 0)
+      : _h(seed ^ (len * m))
+      , _tailLen(0) {}
+
+    void update(const void* key, size_t len)
+    {
+        const unsigned char* data = static_cast<const unsigned char*>(key);
+
+        if (_tailLen > 0) {
+            size_t n = std::min(len, 8 - _tailLen);
+            memcpy(_tail + _tailLen, data, n);
+            _tailLen += n;
+            data += n;
+            len -= n;
+            if (_tailLen < 8) {
+                return;
+            }
+            mix(_tail);
+            _tailLen = 0;
+        }
+
+        const unsigned char* end = data + (len & ~size_t(7));
+        for (; data != end; data += 8) {
+            mix(data);
+        }
+
+        _tailLen = len & 7;
+        memcpy(_tail, data, _tailLen);
+    }
+
+    uint64_t digest() const
+    {
+        uint64_t h = _h;
+
+        switch (_tailLen) {
+            case 7: h ^= uint64_t(_tail[6]) << 48; // fall through
+            case 6: h ^= uint64_t(_tail[5]) << 40; // fall through
+            case 5: h ^= uint64_t(_tail[4]) << 32; // fall through
+            case 4: h ^= uint64_t(_tail[3]) << 24; // fall through
+            case 3: h ^= uint64_t(_tail[2]) << 16; // fall through
+            case 2: h ^= uint64_t(_tail[1]) << 8;  // fall through
+            case 1: h ^= uint64_t(_tail[0]);
+                    h *= m;
+        }
+
+        h ^= h >> r;
+        h *= m;
+        h ^= h >> r;
+        return h;
+    }
+
+private:
+
+    static const uint64_t m = 0xc6a4a7935bd1e995ull;
+    static const int r = 47;
+
+    void mix(const unsigned char* data)
+    {
+        uint64_t k;
+        memcpy(&k, data, 8);
+        k = le64toh(k);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        _h ^= k;
+        _h *= m;
+    }
+
+    uint64_t        _h;
+    size_t          _tailLen;
+    unsigned char   _tail[8];
+};
+
+
+inline uint64_t murmur64(const void* key, size_t len, uint64_t seed = 0)
+{
+    Murmur64 h(len, seed);
+    h.update(key, len);
+    return h.digest();
+}
+
+
+// Content-addressed object store. Every distinct payload is written once,
+// named by its hash and size; output files are hard links to the objects,
+// or reflinks / copies where hard links are not possible. Objects found by
+// name are compared byte by byte before they are shared, payloads whose
+// hash and size collide get numbered names.
+class ContentStore
+{
+public:
+
+    explicit ContentStore(const std::string& dir)
+      : _dir(dir)
+      , _tmpCounter(0)
+      , _objects(0)
+      , _hits(0)
+      , _bytesWritten(0)
+      , _bytesSaved(0)
+    {
+        while (!_dir.empty() && _dir[_dir.size() - 1] == '/') {
+            _dir.erase(_dir.size() - 1);
+        }
+        if (::mkdir(_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("failed to create store " + _dir);
+        }
+    }
+
+    // Stores data under path, sharing the object with every other file of
+    // identical content. path is replaced in one step, it is never seen
+    // missing or partly written.
+    void save(const std::string& path, const std::string& data)
+    {
+        std::string object = put(data);
+
+        std::string tmpPath = tmpName();
+        int err;
+        if (::link(object.c_str(), tmpPath.c_str()) == 0) {
+            int rc = ::rename(tmpPath.c_str(), path.c_str());
+            err = errno;
+            // rename() leaves both names alone when path already is a
+            // link to the object
+            ::unlink(tmpPath.c_str());
+            if (rc == 0) {
+                return;
+            }
+        }
+        else {
+            err = errno;
+        }
+        if (err != EXDEV && err != EMLINK && err != EPERM) {
+            throw std::runtime_error("failed to link " + path);
+        }
+
+        // path is on another file system, or the object has too many
+        // links: a reflink or copy of it is written in its place
+        File src(object, O_RDONLY);
+        AtomicFile dst(path);
+        if (::ioctl(dst.file().fd(), FICLONE, src.fd()) == 0) {
+            ::lseek(dst.file().fd(), data.size(), SEEK_SET);
+        }
+        else {
+            writeAll(dst.file(), data.data(), data.size(), path);
+        }
+        dst.commit();
+    }
+
+    // Moves a file that was already written to path into the store, for
+    // output too large to be handed over in memory. The file is hashed
+    // by reading it back; if the object exists, path is replaced by a
+    // link to it, otherwise path itself becomes the object.
+    void adopt(const std::string& path)
+    {
+        File src(path, O_RDONLY);
+        struct stat st;
+        if (::fstat(src.fd(), &st) != 0) {
+            throw std::runtime_error("failed to stat " + path);
+        }
+
+        uint64_t size = st.st_size;
+        Murmur64 h(size);
+        std::vector<char> buf(1 << 16);
+        ssize_t n;
+        while ((n = src.read(buf.data(), buf.size())) > 0) {
+            h.update(buf.data(), n);
+        }
+
+        std::string tmpPath;
+        for (unsigned collision = 0; ; ++collision) {
+            std::string object = objectPath(h.digest(), size, collision);
+
+            if (::access(object.c_str(), F_OK) != 0) {
+                mkdirFor(object);
+                if (::link(path.c_str(), object.c_str()) == 0) {
+                    ::fchmod(src.fd(), 0444);
+                    _objects++;
+                    _bytesWritten += size;
+                    return;
+                }
+                if (errno != EEXIST && errno != EXDEV && errno != EMLINK && errno != EPERM) {
+                    throw std::runtime_error("failed to store " + object);
+                }
+                if (errno != EEXIST) {
+                    // the store is on another file system: copy the file
+                    // into it
+                    if (tmpPath.empty()) {
+                        tmpPath = tmpName();
+                        try {
+                            File dst(tmpPath, O_WRONLY | O_CREAT | O_EXCL, 0444);
+                            ::lseek(src.fd(), 0, SEEK_SET);
+                            while ((n = src.read(buf.data(), buf.size())) > 0) {
+                                writeAll(dst, buf.data(), n, tmpPath);
+                            }
+                            checkSize(dst, size, tmpPath);
+                        }
+                        catch (...) {
+                            ::unlink(tmpPath.c_str());
+                            throw;
+                        }
+                    }
+                    if (commit(tmpPath, object, size)) {
+                        return;
+                    }
+                }
+            }
+
+            ::lseek(src.fd(), 0, SEEK_SET);
+            if (sameContent(object, src, size)) {
+                if (!tmpPath.empty()) {
+                    ::unlink(tmpPath.c_str());
+                }
+                hit(size);
+                relink(object, path);
+                return;
+            }
+        }
+    }
+
+    size_t objects() const { return _objects; }
+    size_t hits() const { return _hits; }
+    uint64_t bytesWritten() const { return _bytesWritten; }
+    uint64_t bytesSaved() const { return _bytesSaved; }
+
+private:
+
+    // the first payload with a hash and size is named by them, later
+    // ones that collide get a ".collision" suffix
+    std::string objectPath(uint64_t h, uint64_t size, unsigned collision) const
+    {
+        char name[80];
+        int len = snprintf(name, sizeof(name), "/%02x/%014llx-%llx",
+                           unsigned(h >> 56), (unsigned long long)(h & 0xffffffffffffffull),
+                           (unsigned long long)size);
+        if (collision) {
+            snprintf(name + len, sizeof(name) - len, ".%u", collision);
+        }
+        return _dir + name;
+    }
+
+    // File::write may write less than asked for
+    static void writeAll(File& f, const char* data, size_t len, const std::string& path)
+    {
+        for (size_t pos = 0; pos < len; ) {
+            ssize_t n = f.write(data + pos, len - pos);
+            if (n <= 0) {
+                throw std::runtime_error("failed to write " + path);
+            }
+            pos += n;
+        }
+    }
+
+    // an object must never be published short
+    static void checkSize(File& f, uint64_t size, const std::string& path)
+    {
+        struct stat st;
+        if (::fstat(f.fd(), &st) != 0 || uint64_t(st.st_size) != size) {
+            throw std::runtime_error("short write to " + path);
+        }
+    }
+
+    // reads until count bytes or end of file
+    static size_t readFull(File& f, char* buf, size_t count)
+    {
+        size_t done = 0;
+        ssize_t n;
+        while (done < count && (n = f.read(buf + done, count - done)) > 0) {
+            done += n;
+        }
+        return done;
+    }
+
+    // compares object with size bytes of src from its current position
+    bool sameContent(const std::string& object, File& src, uint64_t size) const
+    {
+        File obj(object, O_RDONLY);
+        std::vector<char> a(1 << 16), b(1 << 16);
+        while (size > 0) {
+            size_t want = std::min<uint64_t>(size, a.size());
+            if (readFull(obj, a.data(), want) != want ||
+                readFull(src, b.data(), want) != want ||
+                memcmp(a.data(), b.data(), want) != 0) {
+                return false;
+            }
+            size -= want;
+        }
+        char extra;
+        return readFull(obj, &extra, 1) == 0;
+    }
+
+    bool sameContent(const std::string& object, const std::string& data) const
+    {
+        File obj(object, O_RDONLY);
+        std::vector<char> buf(1 << 16);
+        size_t pos = 0;
+        size_t n;
+        while ((n = readFull(obj, buf.data(), buf.size())) > 0) {
+            if (n > data.size() - pos || memcmp(buf.data(), data.data() + pos, n) != 0) {
+                return false;
+            }
+            pos += n;
+        }
+        return pos == data.size();
+    }
+
+    void mkdirFor(const std::string& object) const
+    {
+        std::string subdir = object.substr(0, _dir.size() + 3);
+        ::mkdir(subdir.c_str(), 0755);
+    }
+
+    std::string tmpName()
+    {
+        char tmp[64];
+        snprintf(tmp, sizeof(tmp), "/.tmp-%d-%zu", int(::getpid()), size_t(_tmpCounter++));
+        return _dir + tmp;
+    }
+
+    void hit(uint64_t size)
+    {
+        _hits++;
+        _bytesSaved += size;
+    }
+
+    // replaces path by a link to object; if that is not possible the
+    // file is left alone, it has the same content anyway
+    void relink(const std::string& object, const std::string& path)
+    {
+        std::string tmpPath = tmpName();
+        if (::link(object.c_str(), tmpPath.c_str()) == 0) {
+            ::rename(tmpPath.c_str(), path.c_str());
+            ::unlink(tmpPath.c_str());
+        }
+    }
+
+    // publishes a fully written private file as object and removes it;
+    // if another writer got there first, it is kept for the caller to
+    // compare and false is returned
+    bool commit(const std::string& tmpPath, const std::string& object, uint64_t size)
+    {
+        if (::link(tmpPath.c_str(), object.c_str()) == 0) {
+            _objects++;
+            _bytesWritten += size;
+            ::unlink(tmpPath.c_str());
+            return true;
+        }
+        if (errno != EEXIST) {
+            ::unlink(tmpPath.c_str());
+            throw std::runtime_error("failed to store " + object);
+        }
+        return false;
+    }
+
+    // returns the object path, writing the object if it does not exist
+    std::string put(const std::string& data)
+    {
+        uint64_t h = murmur64(data.data(), data.size());
+        std::string tmpPath;
+
+        for (unsigned collision = 0; ; ++collision) {
+            std::string object = objectPath(h, data.size(), collision);
+
+            if (::access(object.c_str(), F_OK) != 0) {
+                mkdirFor(object);
+
+                // write to a private name first, so no reader ever sees a
+                // partial object
+                if (tmpPath.empty()) {
+                    tmpPath = tmpName();
+                    try {
+                        File fw(tmpPath, O_WRONLY | O_CREAT | O_EXCL, 0444);
+                        writeAll(fw, data.data(), data.size(), tmpPath);
+                        checkSize(fw, data.size(), tmpPath);
+                    }
+                    catch (...) {
+                        ::unlink(tmpPath.c_str());
+                        throw;
+                    }
+                }
+                if (commit(tmpPath, object, data.size())) {
+                    return object;
+                }
+            }
+
+            if (sameContent(object, data)) {
+                if (!tmpPath.empty()) {
+                    ::unlink(tmpPath.c_str());
+                }
+                hit(data.size());
+                return object;
+            }
+        }
+    }
+
+    std::string             _dir;
+    std::atomic<size_t>     _tmpCounter;
+    std::atomic<size_t>     _objects;
+    std::atomic<size_t>     _hits;
+    std::atomic<uint64_t>   _bytesWritten;
+    std::atomic<uint64_t>   _bytesSaved;
+};
+
+
+#endif // ESOUNPACK_STORE_H
@@ -0,0 +1,216 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_SUBFILES_H
+#define ESOUNPACK_SUBFILES_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "esodata.h"
+#include "recordformat.h"
+
+
+// MNF block 3 data 2: fileId, flags1
+typedef RecordFormat<8,
+    Field<uint32_t, 0, ByteOrder::Little>,
+    Field<uint32_t, 4, ByteOrder::Little>> MNFSubfileIdFormat;
+
+// MNF block 3 data 3: compressedSize, uncompressedSize, contentHash,
+// fileOffset, flags2
+typedef RecordFormat<20,
+    Field<uint32_t, 0, ByteOrder::Little>,
+    Field<uint32_t, 4, ByteOrder::Little>,
+    Field<uint32_t, 8, ByteOrder::Little>,
+    Field<uint32_t, 12, ByteOrder::Little>,
+    Field<uint32_t, 16, ByteOrder::Little>> MNFSubfileLocationFormat;
+
+
+// One MNF entry, as a row of SubfileTable.
+struct SubfileInfo
+{
+    uint32_t    fileId;
+    uint32_t    _maybe_flags1;
+    uint64_t    compressedSize;
+    uint64_t    uncompressedSize;
+    uint32_t    _maybe_contentHash;
+    uint64_t    fileOffset;
+    uint32_t    _maybe_flags2;
+
+    // the second byte of flags2 appears to select the gameNNNN.dat archive
+    unsigned _maybe_archiveIndex() const
+    {
+        return (_maybe_flags2 >> 8) & 0xff;
+    }
+};
+
+
+// The MNF subfile entries stored by column, one array per field, with
+// indexes by fileId and by archive position. Rows are handed out by value.
+class SubfileTable
+{
+public:
+
+    static const size_t npos = ~size_t(0);
+
+    size_t size() const
+    {
+        return _fileId.size();
+    }
+
+    bool empty() const
+    {
+        return _fileId.empty();
+    }
+
+    void resize(size_t n)
+    {
+        for (std::vector<uint32_t>* col : columns()) {
+            col->resize(n);
+        }
+        _byFileId.clear();
+        _byOffset.clear();
+    }
+
+    // decodes MNF block 3 data 2
+    void decodeIds(const char* data, size_t len)
+    {
+        MNFSubfileIdFormat::decodeColumns(data, len, size(),
+                                          _fileId.data(), _flags1.data());
+    }
+
+    // decodes MNF block 3 data 3
+    void decodeLocations(const char* data, size_t len)
+    {
+        MNFSubfileLocationFormat::decodeColumns(data, len, size(),
+                                                _compressedSize.data(), _uncompressedSize.data(),
+                                                _contentHash.data(), _fileOffset.data(),
+                                                _flags2.data());
+    }
+
+    // sorts the indexes; call once all columns are decoded
+    void buildIndex()
+    {
+        size_t n = size();
+        _byFileId.resize(n);
+        _byOffset.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            _byFileId[i] = i;
+            _byOffset[i] = i;
+        }
+        std::stable_sort(_byFileId.begin(), _byFileId.end(), [this](uint32_t a, uint32_t b) {
+            return _fileId[a] < _fileId[b];
+        });
+        std::stable_sort(_byOffset.begin(), _byOffset.end(), [this](uint32_t a, uint32_t b) {
+            return position(a) < position(b);
+        });
+    }
+
+    SubfileInfo operator[](size_t i) const
+    {
+        SubfileInfo info = {
+            _fileId[i], _flags1[i], _compressedSize[i], _uncompressedSize[i],
+            _contentHash[i], _fileOffset[i], _flags2[i],
+        };
+        return info;
+    }
+
+    ArrayView<uint32_t> fileIds() const { return view(_fileId); }
+    ArrayView<uint32_t> compressedSizes() const { return view(_compressedSize); }
+    ArrayView<uint32_t> uncompressedSizes() const { return view(_uncompressedSize); }
+    ArrayView<uint32_t> contentHashes() const { return view(_contentHash); }
+    ArrayView<uint32_t> fileOffsets() const { return view(_fileOffset); }
+
+    unsigned archiveIndex(size_t i) const
+    {
+        return (_flags2[i] >> 8) & 0xff;
+    }
+
+    // row indexes in archive and offset order, for sequential reading
+    const std::vector<uint32_t>& offsetOrder() const
+    {
+        return _byOffset;
+    }
+
+    // first row with fileId, or npos
+    size_t findFileId(uint32_t fileId) const
+    {
+        auto it = std::lower_bound(_byFileId.begin(), _byFileId.end(), fileId,
+                                   [this](uint32_t i, uint32_t id) { return _fileId[i] < id; });
+        return (it != _byFileId.end() && _fileId[*it] == fileId) ? *it : npos;
+    }
+
+    // first row starting at offset of the archive, or npos
+    size_t findOffset(unsigned archiveIndex, uint64_t offset) const
+    {
+        if (offset > UINT32_MAX) {
+            // the MNF cannot point there
+            return npos;
+        }
+        uint64_t pos = (uint64_t(archiveIndex) << 32) | offset;
+        auto it = std::lower_bound(_byOffset.begin(), _byOffset.end(), pos,
+                                   [this](uint32_t i, uint64_t p) { return position(i) < p; });
+        return (it != _byOffset.end() && position(*it) == pos) ? *it : npos;
+    }
+
+private:
+
+    std::vector<std::vector<uint32_t>*> columns()
+    {
+        std::vector<std::vector<uint32_t>*> cols = {
+            &_fileId, &_flags1, &_compressedSize, &_uncompressedSize,
+            &_contentHash, &_fileOffset, &_flags2,
+        };
+        return cols;
+    }
+
+    static ArrayView<uint32_t> view(const std::vector<uint32_t>& col)
+    {
+        return ArrayView<uint32_t>(col.data(), col.size());
+    }
+
+    uint64_t position(size_t i) const
+    {
+        return (uint64_t(archiveIndex(i)) << 32) | _fileOffset[i];
+    }
+
+    std::vector<uint32_t>   _fileId;
+    std::vector<uint32_t>   _flags1;
+    std::vector<uint32_t>   _compressedSize;
+    std::vector<uint32_t>   _uncompressedSize;
+    std::vector<uint32_t>   _contentHash;
+    std::vector<uint32_t>   _fileOffset;
+    std::vector<uint32_t>   _flags2;
+    std::vector<uint32_t>   _byFileId;
+    std::vector<uint32_t>   _byOffset;
+};
+
+
+#endif // ESOUNPACK_SUBFILES_H
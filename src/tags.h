@@ -0,0 +1,358 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_TAGS_H
+#define ESOUNPACK_TAGS_H
+
+#include <ctype.h>
+#include <regex.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// One tag found by a regex rule: its name, the ctags search pattern of
+// the line it is on, and the kind letter.
+struct TagEntry
+{
+    std::string     name;
+    std::string     address;
+    char            kind;
+
+    // the line of a tags file in the extended format
+    std::string line(const std::string& file) const
+    {
+        std::string s;
+        s.reserve(name.size() + file.size() + address.size() + 8);
+        s.append(name).append(1, '\t').append(file).append(1, '\t');
+        s.append(address).append(";\"\t").append(1, kind);
+        return s;
+    }
+};
+
+
+// The regex languages of a ctags options file, from its --langdef,
+// --langmap and --regex-<lang> options. Everything else is ignored.
+class TagRules
+{
+public:
+
+    struct Rule
+    {
+        std::string     pattern;
+        std::string     replacement;
+        char            kind;
+    };
+
+    struct Language
+    {
+        std::string                 name;
+        std::vector<std::string>    extensions;
+        std::vector<Rule>           rules;
+    };
+
+    explicit TagRules(const std::string& path)
+    {
+        std::ifstream in(path.c_str());
+        if (!in) {
+            throw std::runtime_error("failed to open " + path);
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty() && line[line.size() - 1] == '\r') {
+                line.erase(line.size() - 1);
+            }
+            if (!parseOption(line)) {
+                throw std::runtime_error(path + ": bad option " + line);
+            }
+        }
+    }
+
+    const std::vector<Language>& languages() const
+    {
+        return _languages;
+    }
+
+    // the language of path by its extension, or -1
+    int language(const std::string& path) const
+    {
+        size_t slash = path.rfind('/');
+        size_t dot = path.rfind('.');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+            return -1;
+        }
+        for (size_t i = 0; i < _languages.size(); ++i) {
+            const std::vector<std::string>& exts = _languages[i].extensions;
+            if (std::find(exts.begin(), exts.end(), path.substr(dot + 1)) != exts.end()) {
+                return int(i);
+            }
+        }
+        return -1;
+    }
+
+private:
+
+    bool parseOption(const std::string& line)
+    {
+        std::string value;
+        if (line.empty()) {
+            return true;
+        }
+        if (option(line, "--langdef=", value)) {
+            Language lang;
+            lang.name = value;
+            _languages.push_back(lang);
+            return true;
+        }
+        if (option(line, "--langmap=", value)) {
+            size_t colon = value.find(':');
+            Language* lang = find(value.substr(0, colon));
+            if (!lang) {
+                return false;
+            }
+            // ".ext1.ext2", optionally with a leading + to add to the map
+            size_t pos = value.find('.', colon);
+            while (pos != std::string::npos) {
+                size_t next = value.find('.', pos + 1);
+                lang->extensions.push_back(value.substr(pos + 1, next - pos - 1));
+                pos = next;
+            }
+            return true;
+        }
+        if (option(line, "--regex-", value)) {
+            size_t eq = value.find('=');
+            Language* lang = (eq != std::string::npos ? find(value.substr(0, eq)) : NULL);
+            Rule rule;
+            if (!lang || !parseRegex(value.substr(eq + 1), rule)) {
+                return false;
+            }
+            lang->rules.push_back(rule);
+            return true;
+        }
+        return true;
+    }
+
+    // /regex/replacement/[kind-spec/][flags]
+    static bool parseRegex(const std::string& spec, Rule& rule)
+    {
+        if (spec.empty()) {
+            return false;
+        }
+        char delim = spec[0];
+        std::vector<std::string> fields(1);
+        for (size_t i = 1; i < spec.size(); ++i) {
+            if (spec[i] == '\\' && i + 1 < spec.size() && spec[i + 1] == delim) {
+                fields.back().append(1, delim);
+                ++i;
+            }
+            else if (spec[i] == delim) {
+                fields.push_back(std::string());
+            }
+            else {
+                fields.back().append(1, spec[i]);
+            }
+        }
+        if (fields.size() < 3) {
+            return false;
+        }
+        rule.pattern = fields[0];
+        rule.replacement = fields[1];
+        rule.kind = (fields.size() > 3 && !fields[2].empty() ? fields[2][0] : 'r');
+        return true;
+    }
+
+    static bool option(const std::string& line, const char* name, std::string& value)
+    {
+        size_t len = strlen(name);
+        if (line.compare(0, len, name)) {
+            return false;
+        }
+        value = line.substr(len);
+        return true;
+    }
+
+    Language* find(const std::string& name)
+    {
+        for (Language& lang : _languages) {
+            if (lang.name == name) {
+                return &lang;
+            }
+        }
+        return NULL;
+    }
+
+    std::vector<Language>   _languages;
+};
+
+
+// The compiled rules of one TagRules. regexec() serializes callers of the
+// same compiled pattern, so every thread should have its own scanner.
+class TagScanner
+{
+public:
+
+    explicit TagScanner(const TagRules& rules)
+      : _rules(rules)
+    {
+        for (const TagRules::Language& lang : rules.languages()) {
+            _compiled.push_back(std::vector<regex_t>(lang.rules.size()));
+            for (size_t r = 0; r < lang.rules.size(); ++r) {
+                regex_t& re = _compiled.back()[r];
+                if (regcomp(&re, lang.rules[r].pattern.c_str(), REG_EXTENDED | REG_NEWLINE) != 0) {
+                    _compiled.back().resize(r);
+                    freeAll();
+                    throw std::runtime_error("bad regex " + lang.rules[r].pattern);
+                }
+            }
+        }
+    }
+
+    ~TagScanner()
+    {
+        freeAll();
+    }
+
+    // Applies every rule of the language to each line of data, like
+    // ctags does, and appends the tags found.
+    void scan(int language, const char* data, size_t len, std::vector<TagEntry>& tags) const
+    {
+        const TagRules::Language& lang = _rules.languages().at(language);
+        const std::vector<regex_t>& compiled = _compiled.at(language);
+
+        for (size_t pos = 0; pos < len; ) {
+            const char* eol = static_cast<const char*>(memchr(data + pos, '\n', len - pos));
+            size_t next = (eol ? eol - data + 1 : len);
+            size_t end = (eol ? eol - data : len);
+            if (end > pos && data[end - 1] == '\r') {
+                --end;
+            }
+
+            std::string address;
+            for (size_t r = 0; r < compiled.size(); ++r) {
+                regmatch_t m[10];
+                m[0].rm_so = pos;
+                m[0].rm_eo = end;
+                if (regexec(&compiled[r], data, 10, m, REG_STARTEND) != 0) {
+                    continue;
+                }
+                TagEntry tag;
+                tag.name = expand(lang.rules[r].replacement, data, m);
+                if (tag.name.empty()) {
+                    continue;
+                }
+                if (address.empty()) {
+                    address = searchPattern(data + pos, end - pos, eol != NULL);
+                }
+                tag.address = address;
+                tag.kind = lang.rules[r].kind;
+                tags.push_back(tag);
+            }
+            pos = next;
+        }
+    }
+
+private:
+
+    TagScanner(const TagScanner&);
+    TagScanner& operator=(const TagScanner&);
+
+    void freeAll()
+    {
+        for (std::vector<regex_t>& lang : _compiled) {
+            for (regex_t& re : lang) {
+                regfree(&re);
+            }
+        }
+        _compiled.clear();
+    }
+
+    // the replacement with \1 to \9 substituted
+    static std::string expand(const std::string& replacement, const char* data,
+                              const regmatch_t* m)
+    {
+        std::string s;
+        for (size_t i = 0; i < replacement.size(); ++i) {
+            char c = replacement[i];
+            if (c == '\\' && i + 1 < replacement.size() && isdigit(replacement[i + 1])) {
+                const regmatch_t& g = m[replacement[++i] - '0'];
+                if (g.rm_so != -1) {
+                    s.append(data + g.rm_so, g.rm_eo - g.rm_so);
+                }
+            }
+            else {
+                s.append(1, c);
+            }
+        }
+        return s;
+    }
+
+    // /^line$/ with backslashes and slashes escaped; the $ only if the
+    // line ended with a newline
+    static std::string searchPattern(const char* line, size_t len, bool terminated)
+    {
+        std::string s = "/^";
+        for (size_t i = 0; i < len; ++i) {
+            if (line[i] == '\\' || line[i] == '/') {
+                s.append(1, '\\');
+            }
+            s.append(1, line[i]);
+        }
+        s.append(terminated ? "$/" : "/");
+        return s;
+    }
+
+    const TagRules&                     _rules;
+    std::vector<std::vector<regex_t>>   _compiled;
+};
+
+
+// Writes a tags file sorted by byte value, without duplicates, as
+// ctags --sort=yes does.
+inline void writeTagFile(const std::string& path, std::vector<std::string>& lines)
+{
+    std::sort(lines.begin(), lines.end());
+    lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+
+    std::ofstream out(path.c_str(), std::ios::binary);
+    out << "!_TAG_FILE_FORMAT\t2\t/extended format; --format=1 will not append ;\" to lines/\n"
+        << "!_TAG_FILE_SORTED\t1\t/0=unsorted, 1=sorted, 2=foldcase/\n"
+        << "!_TAG_PROGRAM_NAME\teso-unpack\t//\n";
+    for (const std::string& line : lines) {
+        out << line << '\n';
+    }
+    if (!out.flush()) {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
+
+
+#endif // ESOUNPACK_TAGS_H
@@ -0,0 +1,214 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_THREADPOOL_H
+#define ESOUNPACK_THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class WorkerPool
+{
+public:
+
+    explicit WorkerPool(unsigned threads = 0)
+      : _active(0)
+      , _stop(false)
+    {
+        if (threads == 0) {
+            threads = std::thread::hardware_concurrency();
+        }
+        if (threads == 0) {
+            threads = 1;
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            _threads.emplace_back(&WorkerPool::run, this);
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _workAvailable.notify_all();
+        for (auto& t : _threads) {
+            t.join();
+        }
+    }
+
+    unsigned size() const
+    {
+        return _threads.size();
+    }
+
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tasks.push_back(std::move(task));
+        }
+        _workAvailable.notify_one();
+    }
+
+    // waits until all submitted tasks have finished, and rethrows the
+    // first exception thrown by any of them
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _workDone.wait(lock, [this] { return _tasks.empty() && _active == 0; });
+        if (_error) {
+            std::exception_ptr error;
+            std::swap(error, _error);
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Calls func(begin, end) for consecutive ranges of [0, count), at most
+    // grain items long, on the pool and the calling thread. Returns when
+    // all ranges are done; safe to call from within a pool task.
+    template <typename F>
+    void parallelFor(size_t count, size_t grain, F func)
+    {
+        if (grain == 0) {
+            grain = 1;
+        }
+        size_t chunks = (count + grain - 1) / grain;
+        if (chunks == 0) {
+            return;
+        }
+
+        struct State
+        {
+            std::atomic<size_t>     next;
+            std::atomic<size_t>     done;
+            size_t                  chunks;
+            std::mutex              mutex;
+            std::condition_variable finished;
+            std::exception_ptr      error;
+        };
+
+        std::shared_ptr<State> state = std::make_shared<State>();
+        state->next = 0;
+        state->done = 0;
+        state->chunks = chunks;
+
+        // func is only touched while a chunk is outstanding, so helpers
+        // which start after the caller returned never dereference it
+        F* pfunc = &func;
+        auto work = [state, pfunc, count, grain]() {
+            size_t ci;
+            while ((ci = state->next.fetch_add(1)) < state->chunks) {
+                size_t begin = ci * grain;
+                size_t end = std::min(begin + grain, count);
+                try {
+                    (*pfunc)(begin, end);
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    if (!state->error) {
+                        state->error = std::current_exception();
+                    }
+                }
+                if (state->done.fetch_add(1) + 1 == state->chunks) {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    state->finished.notify_all();
+                }
+            }
+        };
+
+        size_t helpers = std::min<size_t>(size(), chunks - 1);
+        for (size_t i = 0; i < helpers; ++i) {
+            submit(work);
+        }
+        work();
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->finished.wait(lock, [&state] { return state->done == state->chunks; });
+        if (state->error) {
+            std::rethrow_exception(state->error);
+        }
+    }
+
+private:
+
+    void run()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _workAvailable.wait(lock, [this] { return _stop || !_tasks.empty(); });
+                if (_tasks.empty()) {
+                    return;
+                }
+                task = std::move(_tasks.front());
+                _tasks.pop_front();
+                _active++;
+            }
+            try {
+                task();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!_error) {
+                    _error = std::current_exception();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _active--;
+                if (_tasks.empty() && _active == 0) {
+                    _workDone.notify_all();
+                }
+            }
+        }
+    }
+
+    std::vector<std::thread>            _threads;
+    std::deque<std::function<void()>>   _tasks;
+    std::mutex                          _mutex;
+    std::condition_variable             _workAvailable;
+    std::condition_variable             _workDone;
+    std::exception_ptr                  _error;
+    unsigned                            _active;
+    bool                                _stop;
+};
+
+
+#endif // ESOUNPACK_THREADPOOL_H
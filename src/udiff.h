@@ -0,0 +1,275 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_UDIFF_H
+#define ESOUNPACK_UDIFF_H
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Line-based unified diff using Myers' O(ND) algorithm. If the files differ
+// in more than maxEdits lines, the differing middle is shown as a single
+// replacement instead.
+class UnifiedDiff
+{
+public:
+
+    UnifiedDiff(const std::string& a, const std::string& b)
+    {
+        split(a, _a);
+        split(b, _b);
+
+        // a last line without newline differs from the same text with one
+        std::unordered_map<std::string, int> ids;
+        for (auto* lines : { &_a, &_b }) {
+            for (auto& ln : *lines) {
+                auto ins = ids.insert(std::make_pair(ln.text, (int)ids.size()));
+                ln.id = 2 * ins.first->second + ln.newline;
+            }
+        }
+    }
+
+    bool write(std::ostream& out, const std::string& labelA, const std::string& labelB,
+               int context = 3, int maxEdits = 4000)
+    {
+        diff(maxEdits);
+
+        if (std::find_if(_ops.begin(), _ops.end(),
+                         [](const Op& op) { return op.type != ' '; }) == _ops.end()) {
+            return false;
+        }
+
+        out << "--- " << labelA << "\n+++ " << labelB << "\n";
+
+        size_t n = _ops.size();
+        size_t i = 0;
+        while (i < n) {
+            // find the next change and extend the hunk while changes
+            // are at most 2 * context lines apart
+            while (i < n && _ops[i].type == ' ') {
+                ++i;
+            }
+            if (i == n) {
+                break;
+            }
+            size_t first = (i > (size_t)context ? i - context : 0);
+            size_t last = i;
+            for (size_t j = i; j < n; ++j) {
+                if (_ops[j].type != ' ') {
+                    last = j;
+                }
+                else if (j - last > 2 * (size_t)context) {
+                    break;
+                }
+            }
+            size_t end = std::min(n, last + 1 + context);
+
+            int aFirst = -1, bFirst = -1, aLen = 0, bLen = 0;
+            for (size_t j = first; j < end; ++j) {
+                const Op& op = _ops[j];
+                if (op.type != '+') {
+                    if (aFirst < 0) aFirst = op.a;
+                    aLen++;
+                }
+                if (op.type != '-') {
+                    if (bFirst < 0) bFirst = op.b;
+                    bLen++;
+                }
+            }
+            if (aFirst < 0) aFirst = _ops[first].a;
+            if (bFirst < 0) bFirst = _ops[first].b;
+
+            char tmp[100];
+            snprintf(tmp, sizeof(tmp), "@@ -%d,%d +%d,%d @@\n",
+                     aLen ? aFirst + 1 : aFirst, aLen, bLen ? bFirst + 1 : bFirst, bLen);
+            out << tmp;
+
+            for (size_t j = first; j < end; ++j) {
+                const Op& op = _ops[j];
+                const Line& ln = (op.type == '+' ? _b[op.b] : _a[op.a]);
+                out << op.type << ln.text << "\n";
+                if (!ln.newline) {
+                    out << "\\ No newline at end of file\n";
+                }
+            }
+            i = end;
+        }
+        return true;
+    }
+
+private:
+
+    struct Line
+    {
+        std::string text;
+        int         id;
+        bool        newline;
+    };
+
+    struct Op
+    {
+        char        type;   // ' ', '-' or '+'
+        int         a;      // line index in a (for '+': next line in a)
+        int         b;      // line index in b (for '-': next line in b)
+    };
+
+    static void split(const std::string& s, std::vector<Line>& lines)
+    {
+        size_t pos = 0;
+        while (pos < s.size()) {
+            size_t nl = s.find('\n', pos);
+            Line ln;
+            ln.id = 0;
+            ln.newline = (nl != std::string::npos);
+            if (!ln.newline) {
+                nl = s.size();
+            }
+            ln.text.assign(s, pos, nl - pos);
+            lines.push_back(std::move(ln));
+            pos = nl + 1;
+        }
+    }
+
+    void diff(int maxEdits)
+    {
+        int n = _a.size();
+        int m = _b.size();
+        int pre = 0;
+        int suf = 0;
+
+        while (pre < n && pre < m && _a[pre].id == _b[pre].id) {
+            ++pre;
+        }
+        while (suf < n - pre && suf < m - pre && _a[n - 1 - suf].id == _b[m - 1 - suf].id) {
+            ++suf;
+        }
+
+        _ops.clear();
+        for (int i = 0; i < pre; ++i) {
+            _ops.push_back(Op{ ' ', i, i });
+        }
+        if (!myers(pre, n - suf, pre, m - suf, maxEdits)) {
+            for (int i = pre; i < n - suf; ++i) {
+                _ops.push_back(Op{ '-', i, pre });
+            }
+            for (int j = pre; j < m - suf; ++j) {
+                _ops.push_back(Op{ '+', n - suf, j });
+            }
+        }
+        for (int i = 0; i < suf; ++i) {
+            _ops.push_back(Op{ ' ', n - suf + i, m - suf + i });
+        }
+    }
+
+    bool myers(int a0, int a1, int b0, int b1, int maxEdits)
+    {
+        int n = a1 - a0;
+        int m = b1 - b0;
+        int maxD = std::min(n + m, maxEdits);
+        std::vector<int> v(2 * maxD + 3, 0);
+        std::vector<std::vector<int>> trace;
+        int off = maxD + 1;
+        int dEnd = -1;
+
+        for (int d = 0; d <= maxD && dEnd < 0; ++d) {
+            for (int k = -d; k <= d; k += 2) {
+                int x;
+                if (k == -d || (k != d && v[off + k - 1] < v[off + k + 1])) {
+                    x = v[off + k + 1];
+                }
+                else {
+                    x = v[off + k - 1] + 1;
+                }
+                int y = x - k;
+                while (x < n && y < m && _a[a0 + x].id == _b[b0 + y].id) {
+                    ++x;
+                    ++y;
+                }
+                v[off + k] = x;
+                if (x >= n && y >= m) {
+                    dEnd = d;
+                }
+            }
+            trace.push_back(std::vector<int>(v.begin() + off - d, v.begin() + off + d + 1));
+        }
+        if (dEnd < 0) {
+            return false;
+        }
+
+        std::vector<Op> ops;
+        int x = n;
+        int y = m;
+        for (int d = dEnd; d > 0; --d) {
+            const std::vector<int>& prev = trace[d - 1];
+            int k = x - y;
+            int prevK;
+            if (k == -d || (k != d && prev[k - 1 + d - 1] < prev[k + 1 + d - 1])) {
+                prevK = k + 1;
+            }
+            else {
+                prevK = k - 1;
+            }
+            int prevX = prev[prevK + d - 1];
+            int prevY = prevX - prevK;
+            while (x > prevX && y > prevY) {
+                --x;
+                --y;
+                ops.push_back(Op{ ' ', a0 + x, b0 + y });
+            }
+            if (prevK == k + 1) {
+                ops.push_back(Op{ '+', a0 + x, b0 + prevY });
+            }
+            else {
+                ops.push_back(Op{ '-', a0 + prevX, b0 + y });
+            }
+            x = prevX;
+            y = prevY;
+        }
+        while (x > 0 && y > 0) {
+            --x;
+            --y;
+            ops.push_back(Op{ ' ', a0 + x, b0 + y });
+        }
+
+        _ops.insert(_ops.end(), ops.rbegin(), ops.rend());
+        return true;
+    }
+
+    std::vector<Line>   _a;
+    std::vector<Line>   _b;
+    std::vector<Op>     _ops;
+};
+
+
+#endif // ESOUNPACK_UDIFF_H
@@ -0,0 +1,186 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_WATCHER_H
+#define ESOUNPACK_WATCHER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <set>
+#include <stdexcept>
+#include <string>
+
+
+// Waits for files in one directory to change, through inotify. A patcher
+// writes many files in a row, so changes are collected until none has
+// come for a quiet period and then reported together. If the directory
+// itself is replaced, it is watched again once it is back.
+class DirWatcher
+{
+public:
+
+    explicit DirWatcher(const std::string& dir)
+      : _dir(dir)
+      , _watch(-1)
+    {
+        _fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (_fd == -1) {
+            throw std::runtime_error(std::string("inotify: ") + ::strerror(errno));
+        }
+        if (::pipe2(_wake, O_NONBLOCK | O_CLOEXEC) != 0) {
+            ::close(_fd);
+            throw std::runtime_error(std::string("pipe: ") + ::strerror(errno));
+        }
+        if (!addWatch()) {
+            ::close(_fd);
+            ::close(_wake[0]);
+            ::close(_wake[1]);
+            throw std::runtime_error("cannot watch " + dir + ": " + ::strerror(errno));
+        }
+    }
+
+    ~DirWatcher()
+    {
+        ::close(_fd);
+        ::close(_wake[0]);
+        ::close(_wake[1]);
+    }
+
+    // Blocks until files for which match(name) is true have changed and
+    // quietMs have passed since the last change, and leaves their names
+    // in changed. Returns false instead on SIGINT or SIGTERM.
+    template <typename F>
+    bool wait(F match, int quietMs, std::set<std::string>& changed)
+    {
+        bool stopping = false;
+        changed.clear();
+
+        stopFd() = _wake[1];
+        struct sigaction sa, oldInt, oldTerm;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &DirWatcher::onSignal;
+        ::sigaction(SIGINT, &sa, &oldInt);
+        ::sigaction(SIGTERM, &sa, &oldTerm);
+
+        while (!stopping) {
+            struct pollfd fds[2] = { { _fd, POLLIN, 0 }, { _wake[0], POLLIN, 0 } };
+            // while the directory is gone, look for it again every second
+            int timeout = (_watch == -1 ? 1000 : changed.empty() ? -1 : quietMs);
+            int n = ::poll(fds, 2, timeout);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("poll: ") + ::strerror(errno));
+            }
+            if (fds[1].revents) {
+                stopping = true;
+            }
+            else if (fds[0].revents) {
+                readEvents(match, changed);
+            }
+            else if (_watch == -1) {
+                if (addWatch()) {
+                    // whatever it holds now is new
+                    changed.insert(std::string());
+                }
+            }
+            else if (!changed.empty()) {
+                break;
+            }
+        }
+
+        ::sigaction(SIGINT, &oldInt, NULL);
+        ::sigaction(SIGTERM, &oldTerm, NULL);
+        stopFd() = -1;
+        return !stopping;
+    }
+
+private:
+
+    bool addWatch()
+    {
+        _watch = ::inotify_add_watch(_fd, _dir.c_str(),
+                                     IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_MOVED_TO |
+                                     IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        return _watch != -1;
+    }
+
+    template <typename F>
+    void readEvents(F& match, std::set<std::string>& changed)
+    {
+        alignas(struct inotify_event) char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+        ssize_t n;
+        while ((n = ::read(_fd, buf, sizeof(buf))) > 0) {
+            for (char* p = buf; p < buf + n; ) {
+                const struct inotify_event* ev = reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    ::inotify_rm_watch(_fd, ev->wd);
+                }
+                if (ev->mask & IN_IGNORED) {
+                    _watch = -1;
+                }
+                else if (ev->len && match(std::string(ev->name))) {
+                    changed.insert(ev->name);
+                }
+            }
+        }
+    }
+
+    static int& stopFd()
+    {
+        static int fd = -1;
+        return fd;
+    }
+
+    static void onSignal(int)
+    {
+        int saved = errno;
+        if (stopFd() != -1) {
+            ssize_t n = ::write(stopFd(), "q", 1);
+            (void)n;
+        }
+        errno = saved;
+    }
+
+    std::string     _dir;
+    int             _fd;
+    int             _watch;
+    int             _wake[2];
+};
+
+
+#endif // ESOUNPACK_WATCHER_H
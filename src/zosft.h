@@ -0,0 +1,396 @@
+//==========================================================================
+//
+//  This is free and unencumbered software released into the public domain.
+//
+//  Anyone is free to copy, modify, publish, use, compile, sell, or
+//  distribute this software, either in source code form or as a compiled
+//  binary, for any purpose, commercial or non-commercial, and by any
+//  means.
+//
+//  In jurisdictions that recognize copyright laws, the author or authors
+//  of this software dedicate any and all copyright interest in the
+//  software to the public domain. We make this dedication for the benefit
+//  of the public at large and to the detriment of our heirs and
+//  successors. We intend this dedication to be an overt act of
+//  relinquishment in perpetuity of all present and future rights to this
+//  software under copyright law.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+//  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+//  IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+//  OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+//  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+//
+//  For more information, please refer to <http://unlicense.org/>
+//
+//==========================================================================
+#ifndef ESOUNPACK_ZOSFT_H
+#define ESOUNPACK_ZOSFT_H
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "esodata.h"
+#include "inflate.h"
+#include "membudget.h"
+#include "pathindex.h"
+#include "threadpool.h"
+
+
+extern "C" uint32_t hash(const char* k, uint32_t length, uint32_t initval);
+extern "C" void hash_batch(const char* const* keys, const uint32_t* lengths,
+                           size_t count, uint32_t initval, uint32_t* results);
+
+
+// initval of the lookup2 hash stored in ESOZOSFTBlock2Data3Record
+static const uint32_t ZOSFT_HASH_INITVAL = 0xa8396u;
+
+
+inline bool is_valid_path(const char* start, const char* end)
+{
+    for (const char* s = start; s != end; ++s) {
+        if (*s == '\0') {
+            return s != start;
+        }
+        if (!isalnum(*s) && !strchr(" +-./_", *s)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+
+// Decoded ZOSFT file table: the header, the inflated data blocks and the
+// filename pool, plus indexes by fileId and by path. Names are resolved by
+// their hash. Nothing is printed here; see dumpZOSFT() for that.
+class ZosftTable
+{
+public:
+
+    typedef ESOZOSFTBlock2Data3Record Record;
+
+    struct DataBlock
+    {
+        size_t      offset;             // of the compressed data
+        size_t      uncompressedSize;   // as declared
+        size_t      compressedSize;
+        bool        ok;                 // inflated to its end
+        std::string uncompressedData;
+    };
+
+    ZosftTable()
+      : _filenamesOffset(0)
+      , _filenamesSize(0) {}
+
+    // data is the subfile payload, starting with the ZOSFT header; the
+    // pool, if any, is used to inflate the blocks and resolve names in
+    // parallel. If there is a budget, the inflated blocks hold a lease on
+    // it for the lifetime of the table. Fails if the layout is broken or
+    // the records do not inflate; other blocks that fail are only marked.
+    bool init(std::string data, WorkerPool* pool = NULL, MemoryBudget* budget = NULL)
+    {
+        _data.swap(data);
+
+        const char* ptr = _data.data();
+        size_t size = _data.size();
+
+        if (size < sizeof(ESOZOSFTHeader)) return false;
+
+        size_t offset = sizeof(ESOZOSFTHeader);
+        std::vector<DataBlock*> blocks;
+
+        for (int bi = 0; bi < 3; ++bi) {
+            ESOBlockType3Header& bh = _blockHeaders[bi];
+            if (!bh.init(ESOLittleEndianBuffer(ptr + offset), size - offset)) return false;
+            offset += sizeof(bh);
+            for (int di = 0; di < 3; ++di) {
+                DataBlock& dh = _dataBlocks[bi][di];
+                dh.offset = offset + 8;
+                dh.compressedSize = 0;
+                dh.uncompressedSize = 0;
+                dh.ok = true;
+                dh.uncompressedData.clear();
+                if (bh.recordCount[di] == 0) continue;
+                if (offset + 8 > size) return false;
+                ESOLittleEndianBuffer buf(ptr + offset);
+                dh.uncompressedSize = buf.u32(0);
+                dh.compressedSize = buf.u32(4);
+                offset += 8 + dh.compressedSize;
+                if (offset > size) return false;
+                blocks.push_back(&dh);
+            }
+        }
+
+        _lease.reset();
+        if (budget) {
+            uint64_t inflatedSize = 0;
+            for (const DataBlock* dh : blocks) {
+                inflatedSize += dh->uncompressedSize + 4;
+            }
+            _lease.reset(new MemoryBudget::Lease(*budget, inflatedSize));
+        }
+
+        auto inflateBlocks = [this, &blocks](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                inflateBlock(*blocks[i]);
+            }
+        };
+
+        if (pool) {
+            pool->parallelFor(blocks.size(), 1, inflateBlocks);
+        }
+        else {
+            inflateBlocks(0, blocks.size());
+        }
+
+        if (!_dataBlocks[1][2].ok) return false;
+
+        // the records are used in place from here on
+        std::string& recs = _dataBlocks[1][2].uncompressedData;
+        ESOZOSFTBlock2Data3Format::toHost(&recs[0], recs.size() / sizeof(Record));
+
+        if (offset + 4 > size) return false;
+
+        _filenamesOffset = offset + 4;
+        _filenamesSize = std::min<size_t>(ESOLittleEndianBuffer(ptr + offset).u32(0),
+                                          size - _filenamesOffset);
+
+        resolveNames(pool);
+        buildPathIndex();
+        return true;
+    }
+
+    const ESOZOSFTHeader& header() const
+    {
+        return *reinterpret_cast<const ESOZOSFTHeader*>(_data.data());
+    }
+
+    const ESOBlockType3Header& blockHeader(int bi) const
+    {
+        return _blockHeaders[bi];
+    }
+
+    const DataBlock& block(int bi, int di) const
+    {
+        return _dataBlocks[bi][di];
+    }
+
+    const std::string& blockData(int bi, int di) const
+    {
+        return _dataBlocks[bi][di].uncompressedData;
+    }
+
+    // a data block as an array of host-endian T
+    template <typename T>
+    ArrayView<T> blockArray(int bi, int di) const
+    {
+        const std::string& data = blockData(bi, di);
+        return ArrayView<T>(reinterpret_cast<const T*>(data.data()), data.size() / sizeof(T));
+    }
+
+    // block 2 data 3: fileId -> filename mapping
+    ArrayView<Record> records() const
+    {
+        return blockArray<Record>(1, 2);
+    }
+
+    size_t recordCount() const
+    {
+        return records().size();
+    }
+
+    // the filename pool, NUL-separated names, pointing into the data
+    const char* filenames() const
+    {
+        return _data.data() + _filenamesOffset;
+    }
+
+    size_t filenamesSize() const
+    {
+        return _filenamesSize;
+    }
+
+    enum NameStatus
+    {
+        NAME_MISSING,   // offset does not point at the start of a name
+        NAME_VERIFIED,  // lookup2 hash of the name matches filenameHash
+        NAME_MISMATCH,  // valid path, but the hash does not match
+        NAME_INVALID,   // neither the hash nor the path is valid
+    };
+
+    NameStatus nameStatus(size_t ri) const
+    {
+        return static_cast<NameStatus>(_nameStatus[ri]);
+    }
+
+    // hash of the name a record points at, valid unless NAME_MISSING
+    uint32_t nameHash(size_t ri) const
+    {
+        return _nameHashes[ri];
+    }
+
+    // returns NULL unless the record's name is verified or a valid path
+    const char* filename(size_t ri) const
+    {
+        NameStatus st = nameStatus(ri);
+        if (st == NAME_VERIFIED || st == NAME_MISMATCH) {
+            return filenames() + records()[ri].filenameOffset;
+        }
+        return NULL;
+    }
+
+    const char* filename(const Record& rec) const
+    {
+        return filename(&rec - records().data());
+    }
+
+    // prefers a record whose name hash verifies
+    const Record* findFileId(uint32_t fileId) const
+    {
+        auto it = std::lower_bound(_fileIdIndex.begin(), _fileIdIndex.end(),
+                                   std::make_pair(fileId, uint32_t(0)));
+        const Record* found = NULL;
+        for (; it != _fileIdIndex.end() && it->first == fileId; ++it) {
+            if (nameStatus(it->second) == NAME_VERIFIED) {
+                return &records()[it->second];
+            }
+            if (!found && filename(it->second)) {
+                found = &records()[it->second];
+            }
+        }
+        return found;
+    }
+
+    const Record* find(const char* path, size_t len) const
+    {
+        uint32_t h = hash(path, len, ZOSFT_HASH_INITVAL);
+        uint32_t k = _pathIndex.find(path, len, h);
+        return k == PathIndex::npos ? NULL : &records()[_pathRecords[k]];
+    }
+
+    const Record* find(const std::string& path) const
+    {
+        return find(path.data(), path.size());
+    }
+
+private:
+
+    void inflateBlock(DataBlock& dh)
+    {
+        size_t uncompressedSize = dh.uncompressedSize;
+        dh.uncompressedData.reserve(uncompressedSize + 4); // make some room for reading dwords
+        dh.uncompressedData.resize(uncompressedSize, '.');
+        dh.ok = inflateString(_data.data() + dh.offset, dh.compressedSize,
+                              &dh.uncompressedData[0], &uncompressedSize);
+        dh.uncompressedData.resize(uncompressedSize);
+    }
+
+    // Hashes every record's name and checks it against the stored
+    // filenameHash; only names failing that are scanned for valid chars.
+    void resolveNames(WorkerPool* pool)
+    {
+        const Record* recs = records().data();
+        size_t n = recordCount();
+        const char* fn = filenames();
+
+        _nameStatus.assign(n, NAME_MISSING);
+        _nameHashes.assign(n, 0);
+
+        auto resolve = [this, recs, fn](size_t begin, size_t end) {
+            std::vector<const char*> names;
+            std::vector<uint32_t> lengths;
+            std::vector<uint32_t> indices;
+            std::vector<uint32_t> hashes;
+
+            for (size_t i = begin; i < end; ++i) {
+                size_t ofs = recs[i].filenameOffset;
+                if (ofs >= _filenamesSize || (ofs != 0 && fn[ofs - 1] != '\0')) {
+                    continue;
+                }
+                const char* nul = static_cast<const char*>(
+                    memchr(fn + ofs, '\0', _filenamesSize - ofs));
+                if (!nul || nul == fn + ofs) {
+                    continue;
+                }
+                names.push_back(fn + ofs);
+                lengths.push_back(nul - (fn + ofs));
+                indices.push_back(i);
+            }
+
+            hashes.resize(names.size());
+            hash_batch(names.data(), lengths.data(), names.size(),
+                       ZOSFT_HASH_INITVAL, hashes.data());
+
+            for (size_t k = 0; k < names.size(); ++k) {
+                size_t i = indices[k];
+                _nameHashes[i] = hashes[k];
+                if (hashes[k] == recs[i].filenameHash) {
+                    _nameStatus[i] = NAME_VERIFIED;
+                }
+                else if (is_valid_path(names[k], fn + _filenamesSize)) {
+                    _nameStatus[i] = NAME_MISMATCH;
+                }
+                else {
+                    _nameStatus[i] = NAME_INVALID;
+                }
+            }
+        };
+
+        if (pool) {
+            pool->parallelFor(n, 4096, resolve);
+        }
+        else {
+            resolve(0, n);
+        }
+
+        _fileIdIndex.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            _fileIdIndex[i] = std::make_pair(recs[i].fileId, uint32_t(i));
+        }
+        std::sort(_fileIdIndex.begin(), _fileIdIndex.end());
+    }
+
+    void buildPathIndex()
+    {
+        size_t n = recordCount();
+        std::vector<const char*> names;
+        std::vector<uint32_t> lengths;
+        std::vector<uint32_t> hashes;
+
+        _pathRecords.clear();
+        for (size_t i = 0; i < n; ++i) {
+            const char* fn = filename(i);
+            if (fn) {
+                names.push_back(fn);
+                lengths.push_back(strlen(fn));
+                hashes.push_back(_nameHashes[i]);
+                _pathRecords.push_back(i);
+            }
+        }
+
+        _pathIndex.build(names.data(), lengths.data(), hashes.data(), names.size());
+    }
+
+    std::unique_ptr<MemoryBudget::Lease> _lease;
+    std::string             _data;
+    ESOBlockType3Header     _blockHeaders[3];
+    DataBlock               _dataBlocks[3][3];
+    size_t                  _filenamesOffset;
+    size_t                  _filenamesSize;
+    std::vector<uint8_t>    _nameStatus;
+    std::vector<uint32_t>   _nameHashes;
+    std::vector<std::pair<uint32_t, uint32_t>> _fileIdIndex;
+    PathIndex               _pathIndex;
+    std::vector<uint32_t>   _pathRecords;
+};
+
+
+#endif // ESOUNPACK_ZOSFT_H
@@ -12,6 +12,7 @@ ver=$(tail -1 "$src/depot/_databuild/databuild.stamp") ||
     die "could not determine game version"
 
 dst="unpacked-$src-$ver"
+store="unpacked-$src-store"
 tags="$dst/tags"
 
 test -f build/Makefile ||
@@ -21,10 +22,8 @@ test -f build/Makefile ||
 )
 make -C build
 
-printf "unpacking %s\n" "$dst"
-build/eso-unpack --save --esodir "$src" --outdir "$dst" 2>build/err >build/out
+printf "unpacking %s and generating %s\n" "$dst" "$tags"
+build/eso-unpack --save --store "$store" --esodir "$src" --outdir "$dst" \
+    --tags "$tags" --tags-options ctags.conf 2>build/err >build/out
 find "$dst/" -empty -delete
-
-printf "generating %s\n" "$tags"
-ctags -Rf "$tags" --options=ctags.conf --totals "$(readlink -m "$dst")"
 ln -sfT "$tags" "tags"